@@ -124,6 +124,22 @@ class WorkStealingQueue {
     The return can be a @std_nullopt if this operation failed (not necessary empty).
     */
     std::optional<T> steal();
+
+    /**
+    @brief steals up to max_count items from the queue, oldest first
+
+    Any threads can try to steal items from the queue.
+    The owner pops without a CAS while more than one item is left, so a
+    single CAS can't safely claim a run of items. Instead the items are
+    claimed back to back, one CAS each, while the cache line holding the
+    top index stays with the thief. Stops at the first failed claim.
+
+    @param out array receiving the stolen items
+    @param max_count the maximum number of items to steal
+
+    @return the number of items stolen
+    */
+    size_t steal_batch(T* out, size_t max_count);
 };
 
 // Constructor
@@ -234,6 +250,32 @@ std::optional<T> WorkStealingQueue<T>::steal() {
   return item;
 }
 
+// Function: steal_batch
+template <typename T>
+size_t WorkStealingQueue<T>::steal_batch(T* out, size_t max_count) {
+  int64_t t = _top.load(std::memory_order_acquire);
+  size_t count = 0;
+
+  while(count < max_count) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = _bottom.load(std::memory_order_acquire);
+    if(t >= b) {
+      break;
+    }
+    Array* a = _array.load(std::memory_order_consume);
+    T item = a->pop(t);
+    if(!_top.compare_exchange_strong(t, t+1,
+                                     std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      break;
+    }
+    out[count++] = item;
+    ++t;
+  }
+
+  return count;
+}
+
 // Function: capacity
 template <typename T>
 int64_t WorkStealingQueue<T>::capacity() const noexcept {
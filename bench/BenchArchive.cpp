@@ -0,0 +1,264 @@
+#include "../src/FileIO.h"
+#include "../src/PackFile.h"
+#include "../tools/PackWriter.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Reads a generated corpus as loose files, from an uncompressed pack and from a compressed pack, and reports the
+// effective throughput: bytes of file data delivered per second. The corpus is mostly mesh-like text, which
+// compresses moderately, plus some random bytes, which don't. After the first iteration the reads come from the page
+// cache, so this compares the read paths and decompression rather than the disk. Files are read into memory, as
+// mapping them would only measure page faults (--map to map them anyway). Every read is compared with the data the
+// corpus was written from, on all three paths so they do the same work, and a mismatch fails the bench.
+// Separately, many shader-sized loose files are read cold, with their pages dropped from the cache before each
+// iteration (on Linux), which is what loading a level's shaders and small assets looks like.
+
+#define TEXT_FILES 16
+#define RANDOM_FILES 4
+#define FILE_SIZE (4 * 1024 * 1024)
+#define SMALL_FILES 2000
+#define SMALL_FILE_MAX_SIZE (48 * 1024)
+
+static std::atomic<int> pendingReads;
+static std::atomic<bool> readFailed;
+
+// compares with the expected contents, which also touches every page so mapped files are really read
+static void consume(const FileData &file, const std::string &path, const std::string &expected) {
+    if (!file.ok) {
+        fprintf(stderr, "%s: read failed\n", path.c_str());
+        readFailed = true;
+    } else if (file.size != expected.size() || memcmp(file.data, expected.data(), file.size) != 0) {
+        fprintf(stderr, "%s: read %zu bytes that differ from the %zu written\n", path.c_str(), file.size, expected.size());
+        readFailed = true;
+    }
+    FileIO::releaseData(file.data, file.size, file.mapped);
+}
+
+static Task<> readLoose(std::string path, const std::string *expected) {
+    consume(co_await FileIO::readFile(path), path, *expected);
+    --pendingReads;
+}
+
+static Task<> readPacked(const PackFile *pack, std::string path, const std::string *expected) {
+    consume(co_await pack->read(pack->find(path)), path, *expected);
+    --pendingReads;
+}
+
+static void waitForReads() {
+    while (pendingReads > 0) {
+        JobSystem::dispatch();
+        std::this_thread::yield();
+    }
+}
+
+template <typename Func>
+static double measureMs(int iterations, Func func) {
+    std::vector<double> times;
+    for (int i = 0; i < iterations; ++i) {
+        auto start = std::chrono::high_resolution_clock::now();
+        func();
+        auto end = std::chrono::high_resolution_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// the files must have been written back (their pages clean) for this to drop them
+static void dropFromPageCache(const std::vector<std::string> &paths) {
+#ifdef __linux__
+    for (auto &path : paths) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+#else
+    (void)paths;
+#endif
+}
+
+template <typename Func>
+static double measureColdMs(int iterations, const std::vector<std::string> &paths, Func func) {
+    std::vector<double> times;
+    for (int i = 0; i < iterations; ++i) {
+        dropFromPageCache(paths);
+        auto start = std::chrono::high_resolution_clock::now();
+        func();
+        auto end = std::chrono::high_resolution_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static bool writeFile(const std::string &path, const std::string &data) {
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp || fwrite(data.data(), 1, data.size(), fp) != data.size() || fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0) {
+        fprintf(stderr, "%s: could not write\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// random sizes up to SMALL_FILE_MAX_SIZE, like compiled shaders
+static bool writeSmallCorpus(const std::string &dir, std::vector<std::string> &paths, std::vector<std::string> &contents) {
+    std::filesystem::create_directories(dir);
+    std::mt19937 rng(5678);
+    for (int i = 0; i < SMALL_FILES; ++i) {
+        std::string data(512 + rng() % (SMALL_FILE_MAX_SIZE - 512), '\0');
+        for (auto &c : data) {
+            c = (char)(rng() % 64);
+        }
+        std::string path = dir + "/shader" + std::to_string(i) + ".spv";
+        if (!writeFile(path, data)) {
+            return false;
+        }
+        paths.push_back(path);
+        contents.push_back(std::move(data));
+    }
+    return true;
+}
+
+static bool writeCorpus(const std::string &dir, std::vector<std::string> &paths, std::vector<std::string> &contents) {
+    std::filesystem::create_directories(dir);
+    std::mt19937 rng(1234);
+    char line[128];
+    for (int i = 0; i < TEXT_FILES + RANDOM_FILES; ++i) {
+        std::string data;
+        while (data.size() < FILE_SIZE) {
+            if (i < TEXT_FILES) {
+                snprintf(line, sizeof(line), "%.4f %.4f %.4f %.3f %.3f %.3f\n",
+                    (rng() % 20000) / 1000.0 - 10, (rng() % 20000) / 1000.0 - 10, (rng() % 20000) / 1000.0 - 10,
+                    (rng() % 2000) / 1000.0 - 1, (rng() % 2000) / 1000.0 - 1, (rng() % 2000) / 1000.0 - 1);
+                data += line;
+            } else {
+                uint32_t value = rng();
+                data.append((const char *)&value, sizeof(value));
+            }
+        }
+        data.resize(FILE_SIZE);
+        std::string path = dir + (i < TEXT_FILES ? "/mesh" : "/noise") + std::to_string(i) + ".bin";
+        if (!writeFile(path, data)) {
+            return false;
+        }
+        paths.push_back(path);
+        contents.push_back(std::move(data));
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 5;
+    int workers = 0;
+    std::string dir = (std::filesystem::temp_directory_path() / "bench_archive").generic_string();
+    bool jsonOutput = false;
+    bool map = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0) {
+            jsonOutput = true;
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--map") == 0) {
+            map = true;
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--json] [--iterations N] [--workers N] [--map] [--dir DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<std::string> paths;
+    std::vector<std::string> contents; // of each path, to check the reads against
+    std::vector<std::string> smallPaths, smallContents;
+    PackWriteStats storedStats, compressedStats;
+    std::string storedPath = dir + "/stored.pak";
+    std::string compressedPath = dir + "/compressed.pak";
+    if (!writeCorpus(dir, paths, contents) || !writeSmallCorpus(dir + "/small", smallPaths, smallContents) || !writePack(storedPath.c_str(), paths, false, storedStats) || !writePack(compressedPath.c_str(), paths, true, compressedStats)) {
+        return 1;
+    }
+    PackFile storedPack, compressedPack;
+    if (!storedPack.open(storedPath) || !compressedPack.open(compressedPath)) {
+        fprintf(stderr, "could not open the packs\n");
+        return 1;
+    }
+
+    if (!map) {
+        FileIO::setMapThreshold(SIZE_MAX);
+    }
+    JobSystem::start(workers);
+    FileIO::start();
+
+    double looseMs = measureMs(iterations, [&] {
+        pendingReads = (int)paths.size();
+        for (size_t i = 0; i < paths.size(); ++i) {
+            spawn(readLoose(paths[i], &contents[i]));
+        }
+        waitForReads();
+    });
+    double storedMs = measureMs(iterations, [&] {
+        pendingReads = (int)paths.size();
+        for (size_t i = 0; i < paths.size(); ++i) {
+            spawn(readPacked(&storedPack, paths[i], &contents[i]));
+        }
+        waitForReads();
+    });
+    double compressedMs = measureMs(iterations, [&] {
+        pendingReads = (int)paths.size();
+        for (size_t i = 0; i < paths.size(); ++i) {
+            spawn(readPacked(&compressedPack, paths[i], &contents[i]));
+        }
+        waitForReads();
+    });
+    double smallColdMs = measureColdMs(iterations, smallPaths, [&] {
+        pendingReads = (int)smallPaths.size();
+        for (size_t i = 0; i < smallPaths.size(); ++i) {
+            spawn(readLoose(smallPaths[i], &smallContents[i]));
+        }
+        waitForReads();
+    });
+
+    bool usingIoUring = FileIO::isUsingIoUring();
+    FileIO::stop();
+    JobSystem::stop();
+    if (readFailed) {
+        fprintf(stderr, "a read failed or returned the wrong data\n");
+        return 1;
+    }
+
+    double megabytes = (double)storedStats.fileBytes / (1024 * 1024);
+    double ratio = (double)compressedStats.fileBytes / compressedStats.packBytes;
+    if (jsonOutput) {
+        printf("{\"bench\":\"archive\",\"files\":%zu,\"megabytes\":%.1f,\"compression_ratio\":%.2f,"
+            "\"loose_mb_per_sec\":%.0f,\"pack_mb_per_sec\":%.0f,\"compressed_pack_mb_per_sec\":%.0f,\"small_files_cold_ms\":%.2f}\n",
+            paths.size(), megabytes, ratio, megabytes / (looseMs / 1000), megabytes / (storedMs / 1000), megabytes / (compressedMs / 1000), smallColdMs);
+    } else {
+        printf("%zu files, %.1f MB, read through %s\n", paths.size(), megabytes, usingIoUring ? "io_uring" : "blocking jobs");
+        printf("loose files:      %8.2f ms, %6.0f MB/s\n", looseMs, megabytes / (looseMs / 1000));
+        printf("pack:             %8.2f ms, %6.0f MB/s\n", storedMs, megabytes / (storedMs / 1000));
+        printf("compressed pack:  %8.2f ms, %6.0f MB/s effective, %zu of %zu files compressed, ratio %.2f\n",
+            compressedMs, megabytes / (compressedMs / 1000), compressedStats.compressedCount, compressedStats.fileCount, ratio);
+        printf("small files cold: %8.2f ms, %6.0f files/s (%d files of up to %d KB)\n",
+            smallColdMs, smallPaths.size() / (smallColdMs / 1000), SMALL_FILES, SMALL_FILE_MAX_SIZE / 1024);
+    }
+    return 0;
+}
@@ -0,0 +1,747 @@
+#include "../src/JobSystem.h"
+#include "../src/TaskGraph.h"
+#include "../src/FrameArena.h"
+#include "../src/Parallel.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <ctime>
+
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+// Job system microbenchmarks. Every workload runs a number of iterations and reports throughput, the iteration time
+// distribution and how busy each thread was. With --json each result is printed as one JSON object per line, so runs
+// before and after a change can be compared by a script.
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static bool jsonOutput = false;
+
+// heap allocations made by each thread, for workloads that check they don't allocate
+static thread_local uint64_t threadHeapAllocations;
+
+void *operator new(size_t size) {
+    ++threadHeapAllocations;
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+
+// flat fan-out: the main thread enqueues every job itself
+static int64_t benchFlatFanOut() {
+    std::atomic<int> counter(0);
+    {
+        JobScope scope;
+        for (int i = 0; i < 1000 * 1000; ++i) {
+            Job::enqueue([&counter] {
+                ++counter;
+            });
+        }
+    }
+    return counter == 1000 * 1000 ? 1000 * 1000 : -1;
+}
+
+// nested fan-out: 1000 jobs that each open a scope and fan out 1000 tiny jobs
+static int64_t benchNestedFanOut() {
+    std::atomic<int> counter(0);
+    {
+        JobScope scope;
+        for (int i = 0; i < 1000; ++i) {
+            Job::enqueue([&counter, &scope] {
+                JobScope scope2(scope);
+                for (int j = 0; j < 1000; ++j) {
+                    Job::enqueue([&counter] {
+                        ++counter;
+                    });
+                }
+            });
+        }
+    }
+    return counter == 1000 * 1000 ? 1000 * 1000 + 1000 : -1;
+}
+
+// same shape, but every leaf job captures more than fits inline in a Job, so it goes through the payload slabs
+static int64_t benchLargeCaptureFanOut() {
+    std::atomic<int> counter(0);
+    {
+        JobScope scope;
+        for (int i = 0; i < 1000; ++i) {
+            Job::enqueue([&counter, &scope] {
+                JobScope scope2(scope);
+                std::array<int, 32> values;
+                values.fill(1);
+                std::string name("a job capture that is too long for small string optimization");
+                for (int j = 0; j < 1000; ++j) {
+                    Job::enqueue([&counter, values, name] {
+                        if (name.size() > 1) {
+                            counter += values[0];
+                        }
+                    });
+                }
+            });
+        }
+    }
+    return counter == 1000 * 1000 ? 1000 * 1000 + 1000 : -1;
+}
+
+// tiny-job storm: a million empty jobs, so only the per-job overhead of the scheduler is measured
+static int64_t benchTinyJobStorm() {
+    {
+        JobScope scope;
+        Job::enqueueBatch(1000 * 1000, [] (int) { });
+    }
+    return 1000 * 1000;
+}
+
+// unbalanced recursion: each call spawns a job for one branch, and recurses into the other
+static void fibJob(int n, std::atomic<int64_t> &result, std::atomic<int64_t> &jobCount) {
+    if (n < 12) {
+        int64_t a = 0, b = 1;
+        for (int i = 0; i < n; ++i) {
+            int64_t c = a + b;
+            a = b;
+            b = c;
+        }
+        result += a;
+        return;
+    }
+    ++jobCount;
+    JobScope scope;
+    Job::enqueue([n, &result, &jobCount] {
+        fibJob(n - 1, result, jobCount);
+    });
+    fibJob(n - 2, result, jobCount);
+}
+
+static int64_t benchFib() {
+    std::atomic<int64_t> result(0);
+    std::atomic<int64_t> jobCount(0);
+    fibJob(32, result, jobCount);
+    return result == 2178309 ? (int64_t)jobCount : -1;
+}
+
+static void quicksortJob(int *begin, int *end, std::atomic<int64_t> &jobCount) {
+    while (end - begin > 2048) {
+        int pivot = begin[(end - begin) / 2];
+        int *mid1 = std::partition(begin, end, [pivot] (int x) { return x < pivot; });
+        int *mid2 = std::partition(mid1, end, [pivot] (int x) { return x == pivot; });
+        ++jobCount;
+        Job::enqueue([begin, mid1, &jobCount] {
+            JobScope scope;
+            quicksortJob(begin, mid1, jobCount);
+        });
+        begin = mid2;
+    }
+    std::sort(begin, end);
+}
+
+static int64_t benchQuicksort() {
+    static std::vector<int> input;
+    if (input.empty()) {
+        std::mt19937 rng(1234);
+        input.resize(4 * 1000 * 1000);
+        for (int &value : input) {
+            value = rng();
+        }
+    }
+    static std::vector<int> values;
+    values = input;
+    std::atomic<int64_t> jobCount(0);
+    {
+        JobScope scope;
+        quicksortJob(values.data(), values.data() + values.size(), jobCount);
+    }
+    return std::is_sorted(values.begin(), values.end()) ? (int64_t)jobCount : -1;
+}
+
+// main-thread-only jobs: workers hand results back through the main thread's external queue
+static int64_t benchMainThreadJobs() {
+    int counter = 0; // only touched on the main thread
+    {
+        JobScope scope;
+        Job::enqueueBatch(100 * 1000, [&counter] (int) {
+            Job::enqueueOnMain([&counter] {
+                ++counter;
+            });
+        });
+    }
+    JobSystem::dispatch(); // drain main jobs enqueued after the scope had already drained its own
+    return counter == 100 * 1000 ? 200 * 1000 : -1;
+}
+
+// skewed costs: mostly short jobs, with every 100th one a hundred times longer. the long ones sit in the middle of
+// the queue, where neither the owner (newest first) nor thieves (oldest first) get to them early, so without
+// duration learning the scope tends to finish with a few threads still busy on long jobs while the rest idle
+static void spinFor(std::chrono::microseconds duration) {
+    auto end = Clock::now() + duration;
+    while (Clock::now() < end) {
+    }
+}
+
+static int64_t benchSkewedCosts() {
+    std::atomic<int> counter(0);
+    {
+        JobScope scope;
+        for (int i = 0; i < 2000; ++i) {
+            if (i % 100 == 50) {
+                Job::enqueue([&counter] {
+                    spinFor(std::chrono::microseconds(2000));
+                    ++counter;
+                });
+            } else {
+                Job::enqueue([&counter] {
+                    spinFor(std::chrono::microseconds(20));
+                    ++counter;
+                });
+            }
+        }
+    }
+    return counter == 2000 ? 2000 : -1;
+}
+
+// the same, learning the durations on the first iteration
+static int64_t benchSkewedCostsLearned() {
+    JobSystem::setDurationLearning(true);
+    int64_t jobs = benchSkewedCosts();
+    JobSystem::setDurationLearning(false);
+    return jobs;
+}
+
+// lazy splitting with duration learning: parallelFor over 2^20 items in grains of 256, where every split-off half
+// (at least half a grain of work) is learned to be a long job. they must still only be split off while the own queues
+// are empty, so the number of parallelForSplit calls stays far below the 4K a split at every grain would give. a call
+// is counted at each range that doesn't continue the previous one on the thread within the same scope (each call has
+// its own)
+static thread_local const JobScope *lastSplitScope;
+static thread_local int lastSplitEnd;
+
+static int64_t benchLazySplitLearned() {
+    const int itemCount = 1 << 20;
+    const int grainSize = 256;
+    std::atomic<int> splitCalls(0);
+    std::vector<float> output(itemCount);
+    JobSystem::setDurationLearning(true, 1);
+    parallelForRange(0, itemCount, [&splitCalls, &output] (int begin, int end) {
+        const JobScope *scope = JobScope::getActiveScope();
+        if (scope != lastSplitScope || begin != lastSplitEnd) {
+            ++splitCalls;
+        }
+        lastSplitScope = scope;
+        lastSplitEnd = end;
+        for (int i = begin; i < end; ++i) {
+            output[i] = std::sqrt((float)i) * std::sin((float)i);
+        }
+    }, grainSize);
+    JobSystem::setDurationLearning(false);
+    if (splitCalls > itemCount / grainSize / 8) {
+        fprintf(stderr, "lazy split: %d parallelForSplit calls\n", splitCalls.load());
+        return -1;
+    }
+    return itemCount / grainSize;
+}
+
+// cancellation: jobs of a cancellable scope spin, mostly on workers that stole them, until they see the scope's
+// token cancelled by the main thread, as do scopes they open. jobs still queued at the cancel are dropped
+static int64_t benchCancelledScope() {
+    const int jobCount = 64;
+    Ref<CancellationToken> token = new CancellationToken();
+    std::atomic<int> started(0), sawCancel(0);
+    {
+        JobScope scope(*token);
+        for (int i = 0; i < jobCount; ++i) {
+            Job::enqueue([&started, &sawCancel] {
+                ++started;
+                auto end = Clock::now() + std::chrono::seconds(1);
+                while (!JobSystem::isCancelled() && Clock::now() < end) {
+                }
+                JobScope inner;
+                if (JobSystem::isCancelled() && inner.isCancelled()) {
+                    ++sawCancel;
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        token->cancel();
+    }
+    return started == sawCancel ? (int64_t)started : -1;
+}
+
+// background children: a background job spawns children both straight from the job and from a scope it opens, and
+// grandchildren from those. all of them must run at background priority, which each checks through a scope it opens
+static int64_t benchBackgroundChildren() {
+    const int childCount = 128;
+    std::atomic<int> done(0), wrong(0);
+    auto check = [&done, &wrong] {
+        JobScope inner;
+        if (inner.getPriority() != JobPriority::Background) {
+            ++wrong;
+        }
+        ++done;
+    };
+    {
+        JobScope scope;
+        Job::enqueue([&check] {
+            for (int i = 0; i < childCount / 2; ++i) {
+                Job::enqueue([&check] {
+                    check();
+                    Job::enqueue([&check] { check(); });
+                });
+            }
+            JobScope jobScope;
+            Job::enqueueBatch(childCount / 2, [&check] (int) {
+                check();
+                Job::enqueue([&check] { check(); });
+            });
+        }, JobPriority::Background);
+    }
+    // jobs enqueued outside a scope of their own are only waited on by their thread's scope
+    while (done < childCount * 2) {
+        std::this_thread::yield();
+    }
+    return wrong ? -1 : childCount * 2 + 1;
+}
+
+// task graph: a diamond, one task fanning out to 64 that are joined by one, built once and run 100 times. every run
+// must respect the dependencies, and once warmed up, runs must not allocate on the calling thread
+static int64_t benchTaskGraph() {
+    const int middleCount = 64;
+    const int runCount = 100;
+    const int warmupRuns = 10;
+    std::atomic<int> clock(0);
+    std::vector<int> stamps(middleCount + 2);
+    TaskGraph graph;
+    auto top = [&clock, &stamps] {
+        stamps[0] = ++clock;
+    };
+    auto bottom = [&clock, &stamps] {
+        stamps[middleCount + 1] = ++clock;
+    };
+    TaskGraph::TaskId topId = graph.addTask(top);
+    TaskGraph::TaskId bottomId = graph.addTask(bottom);
+    for (int i = 1; i <= middleCount; ++i) {
+        TaskGraph::TaskId id = graph.addTask([&clock, &stamps, i] {
+            stamps[i] = ++clock;
+        });
+        graph.addDependency(id, topId);
+        graph.addDependency(bottomId, id);
+    }
+
+    uint64_t allocationsBefore = 0;
+    for (int run = 0; run < runCount; ++run) {
+        if (run == warmupRuns) {
+            allocationsBefore = threadHeapAllocations;
+        }
+        graph.run();
+        for (int i = 1; i <= middleCount; ++i) {
+            if (stamps[i] <= stamps[0] || stamps[i] >= stamps[middleCount + 1]) {
+                return -1;
+            }
+        }
+    }
+    if (threadHeapAllocations != allocationsBefore) {
+        fprintf(stderr, "task graph: %llu allocations after warming up\n", (unsigned long long)(threadHeapAllocations - allocationsBefore));
+        return -1;
+    }
+    return runCount * (middleCount + 2);
+}
+
+// frame arena: 30 frames, in each of which the main thread and 64 worker jobs fill frame vectors. the main thread
+// checks that its data of the two previous frames is still intact, and the jobs check their own. the main thread
+// doesn't run the jobs, so it allocates the same each frame (several blocks, none oversized), and once its
+// generations are warmed up it must not allocate blocks
+static bool fillFrameVector(FrameVector<uint32_t> &values, size_t count, uint32_t seed) {
+    values.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        values.push_back(seed * 2654435761u + (uint32_t)i);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (values[i] != seed * 2654435761u + (uint32_t)i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t getMainArenaBlockAllocations() {
+    for (auto &stats : FrameArena::getStats()) {
+        if (strcmp(stats.threadName, "main") == 0) {
+            return stats.blockAllocations;
+        }
+    }
+    return 0;
+}
+
+static int64_t benchFrameArena() {
+    const int frameCount = 30;
+    const int jobsPerFrame = 64;
+    const int mainVectors = 4;
+    const size_t mainValues = 50 * 1000;
+    const uint32_t *previous[FrameArena::GENERATIONS - 1][mainVectors] = {}; // main's data of the last frames, newest first
+    uint64_t blocksBefore = 0;
+    std::atomic<int> done(0);
+    std::atomic<bool> ok(true);
+    for (int frame = 0; frame < frameCount; ++frame) {
+        FrameArena::beginFrame();
+        if (frame == FrameArena::GENERATIONS) {
+            blocksBefore = getMainArenaBlockAllocations();
+        }
+        for (int i = 0; i < jobsPerFrame; ++i) {
+            Job::enqueueOnWorker([&done, &ok, frame, i] {
+                FrameVector<uint32_t> values;
+                if (!fillFrameVector(values, 1000 + i * 10, frame * jobsPerFrame + i)) {
+                    ok = false;
+                }
+                ++done;
+            });
+        }
+        for (int age = 1; age < FrameArena::GENERATIONS; ++age) {
+            for (int v = 0; v < mainVectors; ++v) {
+                const uint32_t *old = previous[age - 1][v];
+                for (size_t i = 0; old && i < mainValues; i += 997) {
+                    if (old[i] != (uint32_t)((frame - age) * mainVectors + v) * 2654435761u + (uint32_t)i) {
+                        ok = false;
+                        break;
+                    }
+                }
+            }
+        }
+        memmove(previous[1], previous[0], sizeof(previous) - sizeof(previous[0]));
+        for (int v = 0; v < mainVectors; ++v) {
+            FrameVector<uint32_t> values;
+            if (!fillFrameVector(values, mainValues, frame * mainVectors + v)) {
+                ok = false;
+            }
+            previous[0][v] = values.data();
+        }
+        while (done < (frame + 1) * jobsPerFrame) {
+            std::this_thread::yield();
+        }
+    }
+    uint64_t blocksAfter = getMainArenaBlockAllocations();
+    if (blocksAfter != blocksBefore) {
+        fprintf(stderr, "frame arena: %llu block allocations after warming up\n", (unsigned long long)(blocksAfter - blocksBefore));
+        return -1;
+    }
+    if (!ok) {
+        return -1;
+    }
+    return frameCount * (jobsPerFrame + 1);
+}
+
+// external producers: threads outside the job system feed the workers, and the time from enqueue to start is sampled
+static std::vector<double> externalLatencies;
+
+static int64_t benchExternalProducers() {
+    const int producerCount = 2;
+    const int jobsPerProducer = 50 * 1000;
+    std::atomic<int> counter(0);
+    std::vector<double> latencies[producerCount];
+    std::vector<std::thread> producers;
+    for (int p = 0; p < producerCount; ++p) {
+        latencies[p].resize(jobsPerProducer / 100);
+        producers.emplace_back([p, &counter, &latencies] {
+            for (int i = 0; i < jobsPerProducer; ++i) {
+                if (i % 100 == 0) {
+                    double *latency = &latencies[p][i / 100];
+                    auto enqueueTime = Clock::now();
+                    Job::enqueueOnWorker([&counter, latency, enqueueTime] {
+                        *latency = std::chrono::duration<double, std::micro>(Clock::now() - enqueueTime).count();
+                        ++counter;
+                    });
+                } else {
+                    Job::enqueueOnWorker([&counter] {
+                        ++counter;
+                    });
+                }
+            }
+        });
+    }
+    for (auto &producer : producers) {
+        producer.join();
+    }
+    while (counter < producerCount * jobsPerProducer) {
+        JobSystem::dispatch();
+        std::this_thread::yield();
+    }
+    for (auto &l : latencies) {
+        externalLatencies.insert(externalLatencies.end(), l.begin(), l.end());
+    }
+    return producerCount * jobsPerProducer;
+}
+
+
+// Per-thread CPU time, read from /proc by thread name (the job system names its threads main and workerN).
+// A spinning worker counts as busy, so utilization is an upper bound on time spent in jobs.
+static std::map<std::string, uint64_t> readThreadRunTimes() {
+    std::map<std::string, uint64_t> times;
+#ifdef __linux__
+    DIR *dir = opendir("/proc/self/task");
+    if (!dir) {
+        return times;
+    }
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[320], name[64] = {};
+        unsigned long long runNs = 0;
+        snprintf(path, sizeof(path), "/proc/self/task/%s/comm", entry->d_name);
+        if (FILE *fp = fopen(path, "r")) {
+            if (fgets(name, sizeof(name), fp)) {
+                name[strcspn(name, "\n")] = 0;
+            }
+            fclose(fp);
+        }
+        snprintf(path, sizeof(path), "/proc/self/task/%s/schedstat", entry->d_name);
+        if (FILE *fp = fopen(path, "r")) {
+            if (fscanf(fp, "%llu", &runNs) != 1) {
+                runNs = 0;
+            }
+            fclose(fp);
+        }
+        if (strcmp(name, "main") == 0 || strncmp(name, "worker", 6) == 0) {
+            times[name] += runNs;
+        }
+    }
+    closedir(dir);
+#endif
+    return times;
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+template <typename Workload>
+static bool runBench(const char *name, int iterations, Workload workload) {
+    std::vector<double> times;
+    int64_t jobs = 0;
+    uint64_t allocationsAfterFirst = 0;
+    externalLatencies.clear();
+    auto runTimesBefore = readThreadRunTimes();
+    auto benchStart = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        auto statsBefore = JobSystem::getAllocationStats();
+        auto start = Clock::now();
+        int64_t count = workload();
+        auto end = Clock::now();
+        auto statsAfter = JobSystem::getAllocationStats();
+        if (count < 0) {
+            fprintf(stderr, "%s: wrong result\n", name);
+            return false;
+        }
+        jobs += count;
+        if (i > 0) {
+            allocationsAfterFirst += (statsAfter.jobChunkAllocations - statsBefore.jobChunkAllocations)
+                + (statsAfter.payloadChunkAllocations - statsBefore.payloadChunkAllocations)
+                + (statsAfter.payloadHeapAllocations - statsBefore.payloadHeapAllocations);
+        }
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    double wallNs = std::chrono::duration<double, std::nano>(Clock::now() - benchStart).count();
+    auto runTimesAfter = readThreadRunTimes();
+
+    double totalMs = 0;
+    for (double time : times) {
+        totalMs += time;
+    }
+    double jobsPerSecond = jobs / (totalMs / 1000.0);
+    std::sort(times.begin(), times.end());
+    std::sort(externalLatencies.begin(), externalLatencies.end());
+
+    if (jsonOutput) {
+        printf("{\"bench\":\"%s\",\"iterations\":%d,\"jobs\":%lld,\"jobs_per_sec\":%.0f,"
+            "\"min_ms\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"mallocs_after_first\":%llu",
+            name, iterations, (long long)jobs, jobsPerSecond, times.front(), percentile(times, 0.5),
+            percentile(times, 0.99), times.back(), (unsigned long long)allocationsAfterFirst);
+        if (!externalLatencies.empty()) {
+            printf(",\"latency_p50_us\":%.1f,\"latency_p99_us\":%.1f,\"latency_max_us\":%.1f",
+                percentile(externalLatencies, 0.5), percentile(externalLatencies, 0.99), externalLatencies.back());
+        }
+        printf(",\"utilization\":{");
+        bool first = true;
+        for (auto &[thread, after] : runTimesAfter) {
+            printf("%s\"%s\":%.3f", first ? "" : ",", thread.c_str(), (after - runTimesBefore[thread]) / wallNs);
+            first = false;
+        }
+        printf("}}\n");
+    } else {
+        printf("%s: %.0f jobs/s, min %.2f ms, p50 %.2f ms, p99 %.2f ms, max %.2f ms, mallocs after first iteration: %llu\n",
+            name, jobsPerSecond, times.front(), percentile(times, 0.5), percentile(times, 0.99), times.back(),
+            (unsigned long long)allocationsAfterFirst);
+        if (!externalLatencies.empty()) {
+            printf("    enqueue to start latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                percentile(externalLatencies, 0.5), percentile(externalLatencies, 0.99), externalLatencies.back());
+        }
+        if (!runTimesAfter.empty()) {
+            printf("    utilization:");
+            for (auto &[thread, after] : runTimesAfter) {
+                printf(" %s %.0f%%", thread.c_str(), 100.0 * (after - runTimesBefore[thread]) / wallNs);
+            }
+            printf("\n");
+        }
+    }
+    fflush(stdout);
+    return true;
+}
+
+// how long an idle worker takes to pick up a job enqueued on the main thread. the main thread only watches a flag,
+// so the job has to be stolen by a worker
+static void benchWakeLatency(int iterations) {
+    std::vector<double> latencies;
+    for (int i = 0; i < iterations; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50)); // let the workers go idle
+        std::atomic<bool> started(false);
+        Clock::time_point startTime;
+        JobScope scope;
+        auto enqueueTime = Clock::now();
+        Job::enqueue([&started, &startTime] {
+            startTime = Clock::now();
+            started = true;
+        });
+        while (!started) {
+            std::this_thread::yield();
+        }
+        latencies.push_back(std::chrono::duration<double, std::micro>(startTime - enqueueTime).count());
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    if (jsonOutput) {
+        printf("{\"bench\":\"wake latency\",\"iterations\":%d,\"min_us\":%.1f,\"p50_us\":%.1f,\"max_us\":%.1f}\n",
+            iterations, latencies.front(), percentile(latencies, 0.5), latencies.back());
+    } else {
+        printf("wake-up latency: min %.1f us, median %.1f us, max %.1f us\n",
+            latencies.front(), percentile(latencies, 0.5), latencies.back());
+    }
+}
+
+// CPU time burned by the job system while the main thread sleeps and there is no work
+static void benchIdleCpu() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100)); // let the workers go idle
+    std::clock_t cpuStart = std::clock();
+    auto start = Clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    std::clock_t cpuEnd = std::clock();
+    auto end = Clock::now();
+    double cpuSeconds = double(cpuEnd - cpuStart) / CLOCKS_PER_SEC;
+    double wallSeconds = std::chrono::duration<double>(end - start).count();
+    if (jsonOutput) {
+        printf("{\"bench\":\"idle cpu\",\"cpu_percent\":%.2f}\n", 100.0 * cpuSeconds / wallSeconds);
+    } else {
+        printf("idle CPU usage: %.1f%% of one core\n", 100.0 * cpuSeconds / wallSeconds);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 10;
+    int workers = 0;
+    const char *filter = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0) {
+            jsonOutput = true;
+        } else if (strcmp(argv[i], "--fibers") == 0) {
+            if (!JobSystem::setFiberMode(true)) {
+                fprintf(stderr, "fiber mode is not available\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--elastic") == 0 && i + 1 < argc) {
+            JobSystem::setElasticWorkers(atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "usage: %s [--json] [--fibers] [--iterations N] [--workers N] [--elastic MIN] [--filter NAME]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    JobSystem::start(workers);
+
+    struct Bench {
+        const char *name;
+        int64_t (*workload)();
+    };
+    const Bench benches[] = {
+        { "flat fan-out (1M)", benchFlatFanOut },
+        { "nested fan-out (1000x1000)", benchNestedFanOut },
+        { "large capture fan-out (1000x1000)", benchLargeCaptureFanOut },
+        { "tiny job storm (1M)", benchTinyJobStorm },
+        { "fib (32)", benchFib },
+        { "quicksort (4M)", benchQuicksort },
+        { "main thread jobs (100K)", benchMainThreadJobs },
+        { "external producers (2x50K)", benchExternalProducers },
+        { "skewed costs (2000, 1% long)", benchSkewedCosts },
+        { "skewed costs, duration learning (2000, 1% long)", benchSkewedCostsLearned },
+        { "lazy split, duration learning (1M, grain 256)", benchLazySplitLearned },
+        { "cancelled scope (64)", benchCancelledScope },
+        { "background children (1+256)", benchBackgroundChildren },
+        { "task graph (100 runs of 66)", benchTaskGraph },
+        { "frame arena (30 frames)", benchFrameArena },
+    };
+    bool ok = true;
+    for (auto &bench : benches) {
+        if (!filter || strstr(bench.name, filter)) {
+            ok = ok && runBench(bench.name, iterations, bench.workload);
+        }
+    }
+    if (ok && (!filter || strstr("wake latency", filter))) {
+        benchWakeLatency(20);
+    }
+    if (ok && (!filter || strstr("idle cpu", filter))) {
+        benchIdleCpu();
+    }
+
+    JobSystem::stop();
+
+    auto stats = JobSystem::getAllocationStats();
+    auto steals = JobSystem::getStealStats();
+    auto external = JobSystem::getExternalQueueStats();
+    if (jsonOutput) {
+        printf("{\"bench\":\"totals\",\"job_chunks\":%llu,\"payload_chunks\":%llu,\"payload_heap\":%llu,\"fibers\":%llu,"
+            "\"steals_smt\":%llu,\"steals_cache\":%llu,\"steals_package\":%llu,\"steals_remote\":%llu,\"steals_external\":%llu,\"steals_contended\":%llu,"
+            "\"external_peak_depth\":%llu}\n",
+            (unsigned long long)stats.jobChunkAllocations, (unsigned long long)stats.payloadChunkAllocations,
+            (unsigned long long)stats.payloadHeapAllocations, (unsigned long long)stats.fiberAllocations,
+            (unsigned long long)steals.smtSibling,
+            (unsigned long long)steals.sameCache, (unsigned long long)steals.samePackage,
+            (unsigned long long)steals.remote, (unsigned long long)steals.external,
+            (unsigned long long)steals.contended, (unsigned long long)external.peakDepth);
+    } else {
+        printf("total mallocs: job chunks %llu, payload chunks %llu, payload heap %llu, fibers %llu\n",
+            (unsigned long long)stats.jobChunkAllocations, (unsigned long long)stats.payloadChunkAllocations,
+            (unsigned long long)stats.payloadHeapAllocations, (unsigned long long)stats.fiberAllocations);
+        printf("steals: smt sibling %llu, same cache %llu, same package %llu, remote %llu, external %llu, contended %llu\n",
+            (unsigned long long)steals.smtSibling, (unsigned long long)steals.sameCache,
+            (unsigned long long)steals.samePackage, (unsigned long long)steals.remote,
+            (unsigned long long)steals.external, (unsigned long long)steals.contended);
+        printf("external queues: peak depth %llu\n", (unsigned long long)external.peakDepth);
+    }
+    return ok ? 0 : 1;
+}
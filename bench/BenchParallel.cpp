@@ -0,0 +1,98 @@
+#include "../src/Parallel.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <vector>
+
+// scaling of the parallel algorithms from one thread (plain serial code) up to hardware_concurrency() threads
+
+#define ELEMENT_COUNT (8 * 1024 * 1024)
+
+template <typename Func>
+static double measureMs(int iterations, Func func) {
+    std::vector<double> times;
+    for (int i = 0; i < iterations; ++i) {
+        auto start = std::chrono::high_resolution_clock::now();
+        func();
+        auto end = std::chrono::high_resolution_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static float work(int i) {
+    return std::sqrt((float)i) * std::sin((float)i);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 5;
+    int maxThreads = std::max(2, (int)std::thread::hardware_concurrency());
+
+    std::vector<float> output(ELEMENT_COUNT);
+    std::vector<uint32_t> input(ELEMENT_COUNT);
+    std::mt19937 rng(1234);
+    for (auto &value : input) {
+        value = rng();
+    }
+    std::vector<uint32_t> sortData;
+
+    double forMs = measureMs(iterations, [&] {
+        for (int i = 0; i < ELEMENT_COUNT; ++i) {
+            output[i] = work(i);
+        }
+    });
+    double reduceMs = measureMs(iterations, [&] {
+        double sum = 0;
+        for (int i = 0; i < ELEMENT_COUNT; ++i) {
+            sum += input[i];
+        }
+        volatile double result = sum;
+        (void)result;
+    });
+    double sortMs = measureMs(iterations, [&] {
+        sortData = input;
+        std::sort(sortData.begin(), sortData.end());
+    });
+    printf("threads  parallelFor        parallelReduce     parallelSort\n");
+    printf("%7d  %8.2f ms         %8.2f ms        %8.2f ms      (serial)\n", 1, forMs, reduceMs, sortMs);
+
+    for (int threads = 2; threads <= maxThreads; ++threads) {
+        JobSystem::start(threads - 1);
+
+        double parallelForMs = measureMs(iterations, [&] {
+            parallelFor(0, ELEMENT_COUNT, [&output] (int i) {
+                output[i] = work(i);
+            }, 1024);
+        });
+        double parallelReduceMs = measureMs(iterations, [&] {
+            volatile double result = parallelReduce(0, ELEMENT_COUNT, 0.0, [&input] (int begin, int end) {
+                double sum = 0;
+                for (int i = begin; i < end; ++i) {
+                    sum += input[i];
+                }
+                return sum;
+            }, [] (double a, double b) { return a + b; }, 4096);
+            (void)result;
+        });
+        double parallelSortMs = measureMs(iterations, [&] {
+            sortData = input;
+            parallelSort(sortData.begin(), sortData.end());
+        });
+        if (!std::is_sorted(sortData.begin(), sortData.end())) {
+            fprintf(stderr, "parallelSort: result is not sorted\n");
+            return 1;
+        }
+
+        JobSystem::stop();
+
+        printf("%7d  %8.2f ms %5.2fx %8.2f ms %5.2fx %8.2f ms %5.2fx\n", threads,
+            parallelForMs, forMs / parallelForMs, parallelReduceMs, reduceMs / parallelReduceMs, parallelSortMs, sortMs / parallelSortMs);
+    }
+    return 0;
+}
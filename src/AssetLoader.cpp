@@ -1,69 +1,71 @@
 #include "AssetLoader.h"
 #include "JobSystem.h"
+#include "FileIO.h"
+#include "PackFile.h"
+#include "CookedFormats.h"
 #include "Logger.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 #include <cassert>
-#include <functional>
+#include <cstring>
+#include <filesystem>
 #include <mutex>
-#include <condition_variable>
-#include <thread>
-#include <deque>
 #include <vector>
 #include <unordered_map>
 
-#define MAX_IO_THREADS 2
-
 
 template class Asset<Blob>;
 template class Asset<Image>;
 template class Asset<nvrhi::ShaderHandle>;
 template class Asset<nvrhi::TextureHandle>;
 
+Blob::~Blob() {
+    FileIO::releaseData(data, size, mapped);
+}
 
-template<typename T>
-class ConcurrentQueue {
-    std::deque<T> queue;
-    std::mutex mutex;
-    std::condition_variable cond;
 
-public:
-    void push(T &&value) {
-        {
-            std::lock_guard<std::mutex> lock(mutex);
-            queue.push_back(value);
+static nvrhi::IDevice *device;
+
+static std::atomic<int> pendingLoads;
+
+static std::vector<PackFile> packs; // mounted before loading starts. later ones take precedence
+
+// the entry of path in the last mounted pack that has it, or null if it would be read as a loose file
+static const PackEntry *findInPacks(const std::string &path, const PackFile *&pack) {
+    for (auto it = packs.rbegin(); it != packs.rend(); ++it) {
+        if (const PackEntry *entry = it->find(path)) {
+            pack = &*it;
+            return entry;
         }
-        cond.notify_one();
     }
+    pack = nullptr;
+    return nullptr;
+}
 
-    T pop() {
-        std::unique_lock lock(mutex);
-        cond.wait(lock, [this] { return !queue.empty(); });
-        assert(!queue.empty());
-        T result = queue.front();
-        queue.pop_front();
-        return result;
+// whether the cooked form of sourcePath should be loaded instead of the source. cooked files in a pack are
+// authoritative, since a pack is built from the sources and cooked/ together. a loose cooked file is only used while
+// it is at least as new as a loose source, so a source edited without re-running the cooker isn't hidden by stale
+// cooked data (the cooker's sourceHash would tell for sure, but the source would have to be read to check it). each
+// file is stat'ed once
+static bool isCookedCurrent(const std::string &cookedPath, const std::string &sourcePath) {
+    const PackFile *pack;
+    if (findInPacks(cookedPath, pack)) {
+        return true;
     }
-
-    bool empty() {
-        std::lock_guard<std::mutex> lock(mutex);
-        return queue.empty();
+    std::error_code error;
+    auto cookedTime = std::filesystem::last_write_time(cookedPath, error);
+    if (error) {
+        return false;
     }
-};
-
-struct IOAction {
-    bool stopThread;
-    std::function<void ()> perform;
-};
-
-static nvrhi::IDevice *device;
-
-static std::atomic<int> pendingLoads;
-
-static ConcurrentQueue<IOAction> ioActionQueue;
-static std::vector<std::thread> ioThreads;
+    auto sourceTime = std::filesystem::last_write_time(sourcePath, error);
+    if (!error && sourceTime > cookedTime) {
+        logger->warning("Ignoring %s, which is older than %s (run make cook)", cookedPath.c_str(), sourcePath.c_str());
+        return false;
+    }
+    return true;
+}
 
 
 
@@ -74,15 +76,32 @@ protected:
     std::string path;
     std::mutex mutex;
     std::vector<std::coroutine_handle<>> awaiters;
+    Ref<CancellationToken> cancelToken = new CancellationToken();
 
-    void addAwaiter(std::coroutine_handle<> handle) noexcept override {
+    bool addAwaiter(std::coroutine_handle<> handle) noexcept override {
         std::lock_guard<std::mutex> lock(mutex);
         if (this->loaded) {
-            Job::enqueueOnWorker([handle, thisRef = Ref(this)] () {
+            return false;
+        }
+        awaiters.push_back(handle);
+        return true;
+    }
+
+    // on a worker thread the last awaiter continues inline, saving a queue round trip. other threads (blocking
+    // threads, or the main thread) shouldn't get stuck with the awaiters' work, so then they all go to the workers
+    static void resumeAwaiters(std::vector<std::coroutine_handle<>> &handles) {
+        bool resumeLastInline = JobSystem::isWorkerThread() && !handles.empty();
+        size_t enqueueCount = resumeLastInline ? handles.size() - 1 : handles.size();
+        for (size_t i = 0; i < enqueueCount; ++i) {
+            bool enqueued = Job::enqueueOnWorker([handle = handles[i]] () {
                 handle.resume();
-            });
-        } else {
-            awaiters.push_back(handle);
+            }, JobPriority::Background);
+            if (!enqueued) {
+                handles[i].resume(); // rejected by the backpressure policy
+            }
+        }
+        if (resumeLastInline) {
+            handles.back().resume();
         }
     }
 
@@ -92,19 +111,41 @@ public:
     }
     ~AssetImpl() {
         //logger->debug("Destroying %s asset: %s", type.c_str(), path.c_str());
+        if (!this->loaded) {
+            --pendingLoads; // the load was cancelled
+        }
+    }
+
+    CancellationToken *getCancelToken() {
+        return cancelToken.get();
+    }
+
+    // the load checks this before each step, and gives up by dropping its references to the asset
+    bool isCancelled() const {
+        return cancelToken->isCancelled();
+    }
+
+    void cancelLoad() {
+        cancelToken->cancel();
     }
 
     void loadingFinished() {
-        std::lock_guard<std::mutex> lock(mutex);
-        this->loaded = true;
-        for (auto handle : awaiters) {
-            Job::enqueueOnWorker([handle, thisRef = Ref(this)] () {
-                handle.resume();
-            });
+        std::vector<std::coroutine_handle<>> resumed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->loaded = true;
+            resumed.swap(awaiters);
         }
-        awaiters.clear();
+        // the awaiters hold references to this asset, so it stays alive while they continue
+        resumeAwaiters(resumed);
         --pendingLoads;
     }
+
+    // finishes the load with the asset left empty. the awaiters check isFailed()
+    void loadingFailed() {
+        this->failed = true;
+        loadingFinished();
+    }
 };
 
 
@@ -112,24 +153,29 @@ class BlobAssetImpl : public AssetImpl<Blob> {
 public:
     BlobAssetImpl(const std::string &path) : AssetImpl("Blob", path) { }
 
-    void load() {
-        ioActionQueue.push(IOAction { false,
-            [thisRef = Ref(this)] () mutable {
-                FILE *fp = fopen(thisRef->path.c_str(), "rb");
-                assert(fp);
-                fseek(fp, 0, SEEK_END);
-                size_t size = ftell(fp);
-                fseek(fp, 0, SEEK_SET);
-                unsigned char *data = (unsigned char *)malloc(size);
-                size_t n = fread(data, 1, size, fp);
-                assert(n == size);
-                fclose(fp);
-
-                thisRef->asset.data = data;
-                thisRef->asset.size = size;
-                thisRef->loadingFinished();
-            }
-        });
+    Task<> load() {
+        auto thisRef = Ref(this);
+        const PackFile *pack;
+        const PackEntry *entry = findInPacks(path, pack);
+        FileData file;
+        if (entry) {
+            file = co_await pack->read(entry);
+        } else {
+            file = co_await FileIO::readFile(path);
+        }
+        if (isCancelled()) {
+            FileIO::releaseData(file.data, file.size, file.mapped);
+            co_return;
+        }
+        if (!file.ok) {
+            logger->error("Error reading %s", path.c_str());
+            loadingFailed();
+            co_return;
+        }
+        asset.data = file.data;
+        asset.size = file.size;
+        asset.mapped = file.mapped;
+        loadingFinished();
     }
 };
 
@@ -138,14 +184,24 @@ class ImageAssetImpl : public AssetImpl<Image> {
 public:
     ImageAssetImpl(const std::string &path) : AssetImpl("Image", path) { }
 
-    Coroutine load() {
+    Task<> load() {
         auto thisRef = Ref(this);
         auto blobAsset = AssetLoader::getBlob(path);
         auto &blob = co_await *blobAsset;
+        if (isCancelled()) {
+            co_return;
+        }
+        if (blobAsset->isFailed()) {
+            loadingFailed();
+            co_return;
+        }
 
         int width, height, comp;
-        int ok = stbi_info_from_memory(blob.data, blob.size, &width, &height, &comp);
-        assert(ok);
+        if (!stbi_info_from_memory(blob.data, blob.size, &width, &height, &comp)) {
+            logger->error("Error decoding %s: %s", path.c_str(), stbi_failure_reason());
+            loadingFailed();
+            co_return;
+        }
 
         int reqComp = 0;
         nvrhi::Format format;
@@ -158,7 +214,11 @@ public:
         }
 
         asset.data = stbi_load_from_memory(blob.data, blob.size, &width, &height, &comp, reqComp);
-        assert(asset.data);
+        if (!asset.data) {
+            logger->error("Error decoding %s: %s", path.c_str(), stbi_failure_reason());
+            loadingFailed();
+            co_return;
+        }
         asset.format = format;
         asset.width = width;
         asset.height = height;
@@ -174,10 +234,17 @@ class ShaderAssetImpl : public AssetImpl<nvrhi::ShaderHandle> {
 public:
     ShaderAssetImpl(const std::string &path, nvrhi::ShaderType shaderType) : AssetImpl("Shader", path), shaderType(shaderType) { }
 
-    Coroutine load() {
+    Task<> load() {
         auto thisRef = Ref(this);
         auto blobAsset = AssetLoader::getBlob(path);
         auto &blob = co_await *blobAsset;
+        if (isCancelled()) {
+            co_return;
+        }
+        if (blobAsset->isFailed()) {
+            loadingFailed();
+            co_return;
+        }
         asset = device->createShader(nvrhi::ShaderDesc(shaderType), blob.data, blob.size);
         assert(asset);
         loadingFinished();
@@ -195,48 +262,120 @@ class TextureAssetImpl : public AssetImpl<nvrhi::TextureHandle> {
         }
     }
 
-public:
-    TextureAssetImpl(const std::string &path, nvrhi::TextureDimension dimension) : AssetImpl(getDimensionName(dimension), path), dimension(dimension) { }
-
-    Coroutine load() {
-        auto thisRef = Ref(this);
-        auto imageAsset = AssetLoader::getImage(path);
-        auto &image = co_await *imageAsset;
-        int height = image.height;
-
+    // creates the texture, and records the upload of its subresources by writeData into a command list that the
+    // main thread executes
+    template <typename WriteData>
+    void createTexture(nvrhi::Format format, int width, int height, int mipLevels, const WriteData &writeData) {
         auto textureDesc = nvrhi::TextureDesc()
             .setDimension(dimension)
-            .setWidth(image.width)
+            .setWidth(width)
             .setHeight(height)
-            .setFormat(image.format)
+            .setMipLevels(mipLevels)
+            .setFormat(format)
             .setInitialState(nvrhi::ResourceStates::ShaderResource)
             .setKeepInitialState(true)
             .setDebugName(path);
         if (dimension == nvrhi::TextureDimension::TextureCube) {
-            assert(image.width == height / 6);
-            height /= 6;
             textureDesc.setArraySize(6);
-            textureDesc.setHeight(height);
         }
         asset = device->createTexture(textureDesc);
         assert(asset);
 
         auto commandList = device->createCommandList(nvrhi::CommandListParameters().setEnableImmediateExecution(false));
         commandList->open();
-        if (dimension == nvrhi::TextureDimension::TextureCube) {
-            for (int i = 0; i < 6; ++i) {
-                commandList->writeTexture(asset, /* arraySlice = */ i, /* mipLevel = */ 0, image.data + i*image.pitch*height, image.pitch);
-            }
-        } else {
-            commandList->writeTexture(asset, /* arraySlice = */ 0, /* mipLevel = */ 0, image.data, image.pitch);
-        }
+        writeData(commandList);
         commandList->setPermanentTextureState(asset, nvrhi::ResourceStates::ShaderResource);
         commandList->commitBarriers();
         commandList->close();
 
-        Job::enqueueOnMain([thisRef = Ref(this), commandList] () mutable {
+        Job::enqueueOnMain(Job::cancellable(getCancelToken(), [thisRef = Ref(this), commandList] () mutable {
             device->executeCommandList(commandList);
             thisRef->loadingFinished();
+        }));
+    }
+
+    // false if the blob isn't a cooked texture of this dimension, of the current format version
+    bool createCookedTexture(const Blob &blob) {
+        CookedTextureHeader header;
+        if (blob.size < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, blob.data, sizeof(header));
+        nvrhi::Format format;
+        switch (header.format) {
+            case COOKED_R8: format = nvrhi::Format::R8_UNORM; break;
+            case COOKED_RG8: format = nvrhi::Format::RG8_UNORM; break;
+            case COOKED_SRGBA8: format = nvrhi::Format::SRGBA8_UNORM; break;
+            default: return false;
+        }
+        uint32_t arraySize = dimension == nvrhi::TextureDimension::TextureCube ? 6 : 1;
+        if (header.header.magic != COOKED_TEXTURE_MAGIC || header.header.version != COOKED_FORMAT_VERSION
+                || header.arraySize != arraySize || !header.width || !header.height || !header.mipLevels || header.mipLevels > 16) {
+            return false;
+        }
+        uint64_t size = sizeof(header);
+        for (uint32_t mip = 0; mip < header.mipLevels; ++mip) {
+            size += (uint64_t)std::max(1u, header.width >> mip) * std::max(1u, header.height >> mip) * header.format * arraySize;
+        }
+        if (size != blob.size) {
+            return false;
+        }
+
+        createTexture(format, header.width, header.height, header.mipLevels, [&] (nvrhi::ICommandList *commandList) {
+            const unsigned char *data = blob.data + sizeof(header);
+            for (uint32_t slice = 0; slice < arraySize; ++slice) {
+                for (uint32_t mip = 0; mip < header.mipLevels; ++mip) {
+                    uint32_t pitch = std::max(1u, header.width >> mip) * header.format;
+                    commandList->writeTexture(asset, slice, mip, data, pitch);
+                    data += (size_t)pitch * std::max(1u, header.height >> mip);
+                }
+            }
+        });
+        return true;
+    }
+
+public:
+    TextureAssetImpl(const std::string &path, nvrhi::TextureDimension dimension) : AssetImpl(getDimensionName(dimension), path), dimension(dimension) { }
+
+    // prefers a current cooked texture (see tools/Cooker.cpp and isCookedCurrent), which is uploaded as is with its
+    // mips. without one, the source image is decoded, and only its top mip is uploaded
+    Task<> load() {
+        auto thisRef = Ref(this);
+        std::string cookedPath = getCookedPath(path, COOKED_TEXTURE_EXTENSION);
+        if (isCookedCurrent(cookedPath, path)) {
+            auto blobAsset = AssetLoader::getBlob(cookedPath);
+            auto &blob = co_await *blobAsset;
+            if (isCancelled()) {
+                co_return;
+            }
+            if (!blobAsset->isFailed() && createCookedTexture(blob)) {
+                co_return;
+            }
+            logger->warning("Ignoring %s, which is not a cooked %s", cookedPath.c_str(), type.c_str());
+        }
+
+        auto imageAsset = AssetLoader::getImage(path);
+        auto &image = co_await *imageAsset;
+        if (isCancelled()) {
+            co_return;
+        }
+        if (imageAsset->isFailed()) {
+            loadingFailed();
+            co_return;
+        }
+        int height = image.height;
+        if (dimension == nvrhi::TextureDimension::TextureCube) {
+            assert(image.width == height / 6);
+            height /= 6;
+        }
+        createTexture(image.format, image.width, height, 1, [&] (nvrhi::ICommandList *commandList) {
+            if (dimension == nvrhi::TextureDimension::TextureCube) {
+                for (int i = 0; i < 6; ++i) {
+                    commandList->writeTexture(asset, /* arraySlice = */ i, /* mipLevel = */ 0, image.data + i*image.pitch*height, image.pitch);
+                }
+            } else {
+                commandList->writeTexture(asset, /* arraySlice = */ 0, /* mipLevel = */ 0, image.data, image.pitch);
+            }
         });
     }
 };
@@ -262,22 +401,40 @@ public:
             asset = createAsset(path);
             map.insert({path, asset});
             ++pendingLoads;
-            Job::enqueueOnWorker([asset] () mutable {
-                asset->load();
-            });
+            Job::enqueueOnWorker(Job::cancellable(asset->getCancelToken(), [asset] () mutable {
+                spawn(asset->load());
+            }), JobPriority::Background);
         }
         return asset;
     }
 
-    void garbageCollect(bool incremental) {
+    // erases assets only referenced by the map. loads that were abandoned are cancelled and erased too, but loaded
+    // assets are kept with keepLoaded (for GPU resources that may still be in use by in-flight frames)
+    void garbageCollect(bool incremental, bool keepLoaded = false) {
         std::lock_guard<std::mutex> lock(mutex);
-        for (auto &e : map) {
-            if (e.second->getRefCount() == 1) {
-                map.erase(e.first);
-                if (incremental) {
-                    break; // one is enough
+        for (auto it = map.begin(); it != map.end(); ) {
+            T *asset = it->second.get();
+            // the count is read first, since a load drops its references only after setting loaded. until then the
+            // load holds at least one, so a count of 2 means no one else does. we hold the map's lock, so no one
+            // can get a new one
+            int refCount = asset->getRefCount();
+            bool erase;
+            if (asset->isLoaded()) {
+                erase = refCount == 1 && !keepLoaded;
+            } else {
+                erase = refCount <= 2;
+                if (erase) {
+                    asset->cancelLoad();
                 }
             }
+            if (!erase) {
+                ++it;
+                continue;
+            }
+            it = map.erase(it);
+            if (incremental) {
+                break; // one is enough
+            }
         }
     }
 
@@ -296,46 +453,38 @@ static AssetMap<TextureAssetImpl> textureCubeAssets;
 
 void AssetLoader::initialize(nvrhi::IDevice *dev) {
     device = dev;
-    for (int i = 0; i < MAX_IO_THREADS; ++i) {
-        ioThreads.emplace_back([] {
-            for (;;) {
-                auto action = ioActionQueue.pop();
-                if (action.stopThread) {
-                    logger->debug("Stopping IO thread.");
-                    break;
-                }
-                action.perform();
-            }
-        });
-    }
+    FileIO::start();
 }
 
 void AssetLoader::cleanup() {
     while (pendingLoads > 0) {
         JobSystem::dispatch();
     }
-    for (int i = 0; i < MAX_IO_THREADS; ++i) {
-        ioActionQueue.push(IOAction { true });
-    }
-    for (auto &thread : ioThreads) {
-        thread.join();
-    }
-    assert(ioActionQueue.empty());
-    ioThreads.clear();
     blobAssets.clear();
     imageAssets.clear();
     shaderAssets.clear();
     texture2DAssets.clear();
     textureCubeAssets.clear();
+    FileIO::stop();
+    packs.clear();
     device = nullptr;
 }
 
+bool AssetLoader::mountPack(const std::string &path) {
+    PackFile pack;
+    if (!pack.open(path)) {
+        return false;
+    }
+    packs.push_back(std::move(pack));
+    return true;
+}
+
 void AssetLoader::garbageCollect(bool incremental) {
     blobAssets.garbageCollect(incremental);
     imageAssets.garbageCollect(incremental);
-    //shaderAssets.garbageCollect(incremental);
-    //texture2DAssets.garbageCollect(incremental);
-    //textureCubeAssets.garbageCollect(incremental);
+    shaderAssets.garbageCollect(incremental, true);
+    texture2DAssets.garbageCollect(incremental, true);
+    textureCubeAssets.garbageCollect(incremental, true);
 }
 
 BlobAssetHandle AssetLoader::getBlob(const std::string &path) {
@@ -2,30 +2,21 @@
 
 #include <nvrhi/nvrhi.h>
 #include "RefCounted.h"
-#include <coroutine>
-
-class Coroutine {
-public:
-    struct Promise {
-        Coroutine get_return_object() { return Coroutine {}; }
-        void unhandled_exception() noexcept { }
-        void return_void() noexcept { }
-        std::suspend_never initial_suspend() noexcept { return {}; }
-        std::suspend_never final_suspend() noexcept { return {}; }
-    };
-    using promise_type = Promise;
-};
+#include "Task.h"
 
 template <typename T>
 class Asset : public RefCounted {
 protected:
     std::atomic<bool> loaded = false;
+    bool failed = false; // set before loaded, if the asset couldn't be loaded. it is then left empty
     T asset;
 
-    virtual void addAwaiter(std::coroutine_handle<> handle) noexcept = 0;
+    // returns false if already loaded, in which case the awaiter continues right away
+    virtual bool addAwaiter(std::coroutine_handle<> handle) noexcept = 0;
 
 public:
     bool isLoaded() const noexcept { return loaded; }
+    bool isFailed() const noexcept { return loaded && failed; } // loaded, but empty
 
     const T &get() const noexcept {
         assert(loaded);
@@ -36,18 +27,21 @@ public:
         struct Awaiter {
             Asset *asset;
             bool await_ready() const noexcept { return asset->loaded; }
-            void await_suspend(std::coroutine_handle<> handle) noexcept { asset->addAwaiter(handle); }
+            bool await_suspend(std::coroutine_handle<> handle) noexcept { return asset->addAwaiter(handle); }
             const T &await_resume() const noexcept { return asset->get(); }
         };
         return Awaiter { this };
     }
 };
 
+// contents of a file. large files are mapped rather than copied into memory (see FileIO::setMapThreshold), so
+// the data is read-only
 struct Blob {
     size_t size = 0;
     unsigned char *data = nullptr;
+    bool mapped = false;
 
-    ~Blob() { free(data); }
+    ~Blob();
     Blob() = default;
     Blob(const Blob &) = delete;
     Blob &operator=(const Blob &) = delete;
@@ -81,6 +75,8 @@ public:
     static void initialize(nvrhi::IDevice *dev);
     static void cleanup();
     static void garbageCollect(bool incremental = false);
+    // assets found in mounted packs are read from there instead of the loose files (call before loading assets)
+    static bool mountPack(const std::string &path);
     static BlobAssetHandle getBlob(const std::string &path);
     static ImageAssetHandle getImage(const std::string &path);
     static ShaderAssetHandle getShader(const std::string &path, nvrhi::ShaderType type);
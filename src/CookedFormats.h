@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Formats written by the cooker (tools/Cooker.cpp) into COOKED_DIR, which mirrors the source tree: the cooked form of
+// "assets/textures/space_cubemap.jpg" is "cooked/assets/textures/space_cubemap.jpg.tex". Every file starts with a
+// CookedHeader. sourceHash covers the source file's content and the cooker version, so the cooker can tell from an
+// existing output whether it is still current. The game uses cooked files from a pack as they are, and loose ones only
+// while they are not older than a loose source (see isCookedCurrent in AssetLoader.cpp).
+#define COOKED_DIR "cooked"
+#define COOKED_FORMAT_VERSION 1
+#define COOKED_TEXTURE_MAGIC 0x58455456 // "VTEX"
+#define COOKED_MESH_MAGIC 0x48534d56 // "VMSH"
+#define COOKED_TEXTURE_EXTENSION ".tex"
+#define COOKED_MESH_EXTENSION ".mesh"
+
+struct CookedHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+};
+
+enum CookedTextureFormat : uint32_t {
+    COOKED_R8 = 1,
+    COOKED_RG8 = 2,
+    COOKED_SRGBA8 = 4, // the value is the bytes per pixel
+};
+
+// Followed by the pixels of each array slice (the 6 faces of a cube, +X -X +Y -Y +Z -Z), each slice being its mip
+// chain from the full size down, each mip tightly packed rows of max(1, width >> mip) pixels.
+struct CookedTextureHeader {
+    CookedHeader header;
+    uint32_t format; // CookedTextureFormat
+    uint32_t width; // of a slice
+    uint32_t height;
+    uint32_t arraySize; // 6 for cubes, else 1
+    uint32_t mipLevels;
+    uint32_t reserved;
+};
+
+// Followed by vertexCount vertices of 3 floats of position, and 3 of normal if COOKED_MESH_NORMALS is set, then
+// indexCount uint32_t indices of triangles.
+#define COOKED_MESH_NORMALS 1
+
+struct CookedMeshHeader {
+    CookedHeader header;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(CookedTextureHeader) == 40 && sizeof(CookedMeshHeader) == 32);
+
+inline std::string getCookedPath(const std::string &sourcePath, const char *extension) {
+    return COOKED_DIR "/" + sourcePath + extension;
+}
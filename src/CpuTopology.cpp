@@ -0,0 +1,110 @@
+#include "CpuTopology.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+#ifdef __linux__
+// reads the first integer in a file. for CPU lists like "0-3,8-11" that is the lowest CPU in the list
+static bool readFirstInt(const char *path, int &value) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fscanf(fp, "%d", &value) == 1;
+    fclose(fp);
+    return ok;
+}
+
+static int readLastLevelCache(int cpu) {
+    char path[128];
+    int bestLevel = 0;
+    int cache = -1;
+    for (int index = 0; index < 8; ++index) {
+        int level, firstCpu;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        if (!readFirstInt(path, level)) {
+            break;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+        if (level > bestLevel && readFirstInt(path, firstCpu)) {
+            bestLevel = level;
+            cache = firstCpu;
+        }
+    }
+    return cache;
+}
+#endif
+
+std::vector<CpuInfo> readCpuTopology() {
+    std::vector<CpuInfo> cpus;
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return cpus;
+    }
+    char path[128];
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        CpuInfo info;
+        info.cpu = cpu;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        if (!readFirstInt(path, info.core)) {
+            cpus.clear();
+            return cpus;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        if (!readFirstInt(path, info.package)) {
+            info.package = 0;
+        }
+        info.cache = readLastLevelCache(cpu);
+        info.smtIndex = 0;
+        for (auto &other : cpus) {
+            if (other.core == info.core) {
+                ++info.smtIndex;
+            }
+        }
+        cpus.push_back(info);
+    }
+    std::sort(cpus.begin(), cpus.end(), [] (const CpuInfo &a, const CpuInfo &b) {
+        if (a.smtIndex != b.smtIndex) return a.smtIndex < b.smtIndex;
+        if (a.package != b.package) return a.package < b.package;
+        if (a.cache != b.cache) return a.cache < b.cache;
+        return a.cpu < b.cpu;
+    });
+#endif
+    return cpus;
+}
+
+CpuDistance getCpuDistance(const CpuInfo &a, const CpuInfo &b) {
+    if (a.core == b.core) {
+        return CpuDistance::SmtSibling;
+    }
+    if (a.cache >= 0 && a.cache == b.cache) {
+        return CpuDistance::SameCache;
+    }
+    if (a.package == b.package) {
+        return CpuDistance::SamePackage;
+    }
+    return CpuDistance::Remote;
+}
+
+bool pinCurrentThreadToCpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
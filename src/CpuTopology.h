@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+
+// Where a logical CPU sits in the core/cache/package hierarchy
+struct CpuInfo {
+    int cpu;      // logical CPU number
+    int core;     // lowest CPU sharing the physical core, so SMT siblings have the same value
+    int cache;    // lowest CPU sharing the last level cache, or -1 if unknown
+    int package;  // physical package (socket)
+    int smtIndex; // position among the SMT siblings of the core
+};
+
+enum class CpuDistance {
+    SmtSibling,
+    SameCache,
+    SamePackage,
+    Remote,
+};
+
+// The CPUs this process may run on, read from /sys/devices/system/cpu. Ordered so that any prefix spreads over the
+// physical cores before using SMT siblings, and fills one last level cache before moving on to the next.
+// Empty when the topology is unavailable (like on other platforms than Linux).
+std::vector<CpuInfo> readCpuTopology();
+
+CpuDistance getCpuDistance(const CpuInfo &a, const CpuInfo &b);
+
+bool pinCurrentThreadToCpu(int cpu);
@@ -98,7 +98,7 @@ void drawDebugLine(const glm::vec3 &a, const glm::vec3 &b, const glm::vec4 &colo
 
 void updateDebugLines(RenderContext &context) {
     if (!lineGraphicsPipeline) {
-        if (!vertShader->isLoaded() || !fragShader->isLoaded()) {
+        if (!vertShader->isLoaded() || !fragShader->isLoaded() || vertShader->isFailed() || fragShader->isFailed()) {
             return;
         }
         doInit(context);
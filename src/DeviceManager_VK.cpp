@@ -23,6 +23,7 @@
 // adapted from https://github.com/NVIDIAGameWorks/donut
 
 #include "DeviceManager.h"
+#include "JobSystem.h"
 
 #if USE_VULKAN
 
@@ -30,6 +31,8 @@
 #include <sstream>
 #include <queue>
 #include <unordered_set>
+#include <thread>
+#include <chrono>
 
 #include <nvrhi/validation.h>
 
@@ -41,6 +44,23 @@ VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 
 #define CHECK(a) if (!(a)) { return false; }
 
+#define GPU_WAIT_STEP_NS 100000 // blocking wait per step while there are no jobs to run (0.1 ms)
+
+// Waits for the GPU or the presentation engine while running jobs on this thread, instead of blocking in the driver.
+// poll(timeout) returns true when the wait is over. It's called with a timeout of zero after each job, and with a
+// short one when there was no job to run, so the thread doesn't spin a core while the GPU catches up.
+template <typename Poll>
+static void waitRunningJobs(Poll poll)
+{
+    while (!poll(0))
+    {
+        if (!JobSystem::runPendingJob() && poll(GPU_WAIT_STEP_NS))
+        {
+            break;
+        }
+    }
+}
+
 
 class DeviceManager_VK : public DeviceManager
 {
@@ -234,6 +254,7 @@ private:
     nvrhi::CommandListHandle m_BarrierCommandList;
     std::vector<vk::Semaphore> m_PresentSemaphores;
     uint32_t m_PresentSemaphoreIndex = 0;
+    vk::Fence m_PresentIdleFence; // signaled when the present queue has gone idle, polled instead of waitIdle
 
     std::queue<nvrhi::EventQueryHandle> m_FramesInFlight;
     std::vector<nvrhi::EventQueryHandle> m_QueryPool;
@@ -1109,6 +1130,11 @@ bool DeviceManager_VK::createSwapChain()
         m_PresentSemaphores.push_back(m_VulkanDevice.createSemaphore(vk::SemaphoreCreateInfo()));
     }
 
+    if (!m_PresentIdleFence)
+    {
+        m_PresentIdleFence = m_VulkanDevice.createFence(vk::FenceCreateInfo());
+    }
+
     return true;
 }
 
@@ -1125,6 +1151,12 @@ void DeviceManager_VK::destroyDeviceAndSwapChain()
         }
     }
 
+    if (m_PresentIdleFence)
+    {
+        m_VulkanDevice.destroyFence(m_PresentIdleFence);
+        m_PresentIdleFence = vk::Fence();
+    }
+
     m_BarrierCommandList = nullptr;
 
     m_NvrhiDevice = nullptr;
@@ -1162,11 +1194,15 @@ bool DeviceManager_VK::beginFrame()
 
     const auto& semaphore = m_PresentSemaphores[m_PresentSemaphoreIndex];
 
-    const vk::Result res = m_VulkanDevice.acquireNextImageKHR(m_SwapChain,
-                                                      UINT64_MAX, // timeout
-                                                      semaphore,
-                                                      vk::Fence(),
-                                                      &m_SwapChainIndex);
+    vk::Result res;
+    waitRunningJobs([&](uint64_t timeout) {
+        res = m_VulkanDevice.acquireNextImageKHR(m_SwapChain,
+                                                 timeout,
+                                                 semaphore,
+                                                 vk::Fence(),
+                                                 &m_SwapChainIndex);
+        return res != vk::Result::eNotReady && res != vk::Result::eTimeout;
+    });
 
     if (res == vk::Result::eErrorOutOfDateKHR)
     {
@@ -1214,7 +1250,20 @@ void DeviceManager_VK::present()
 #ifndef _WIN32
     if (m_DeviceParams.vsyncEnabled)
     {
-        m_PresentQueue.waitIdle();
+        // same as waitIdle: an empty submission's fence signals once everything submitted before it has completed
+        vk::Result submitResult = m_PresentQueue.submit(0, nullptr, m_PresentIdleFence);
+        assert(submitResult == vk::Result::eSuccess);
+        (void)submitResult;
+        // anything but a timeout ends the wait, so an error like a lost device surfaces here as it did with waitIdle,
+        // instead of the thread running jobs forever
+        vk::Result fenceResult;
+        waitRunningJobs([&](uint64_t timeout) {
+            fenceResult = m_VulkanDevice.waitForFences(1, &m_PresentIdleFence, VK_TRUE, timeout);
+            return fenceResult != vk::Result::eTimeout;
+        });
+        assert(fenceResult == vk::Result::eSuccess);
+        (void)fenceResult;
+        (void)m_VulkanDevice.resetFences(1, &m_PresentIdleFence);
     }
 #endif
 
@@ -1223,7 +1272,17 @@ void DeviceManager_VK::present()
         auto query = m_FramesInFlight.front();
         m_FramesInFlight.pop();
 
-        m_NvrhiDevice->waitEventQuery(query);
+        waitRunningJobs([&](uint64_t timeout) {
+            if (m_NvrhiDevice->pollEventQuery(query))
+            {
+                return true;
+            }
+            if (timeout)
+            {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(timeout)); // event queries can't be waited on with a timeout
+            }
+            return false;
+        });
 
         m_QueryPool.push_back(query);
     }
@@ -0,0 +1,542 @@
+#include "FileIO.h"
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#endif
+
+#define IO_URING_ENTRIES 256 // submission queue depth. the completion queue is twice as deep
+#define IO_MAX_READ (1 << 30) // per read operation. larger files take several
+#define DEFAULT_MAP_THRESHOLD (256 * 1024)
+
+
+static size_t mapThreshold = DEFAULT_MAP_THRESHOLD;
+
+#ifdef __linux__
+// the hints start readahead of the whole range right away, and let the kernel drop pages behind the reader. ranges
+// must start on a page
+static unsigned char *mapFile(int fd, uint64_t offset, size_t size) {
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    if (offset % pageSize) {
+        return nullptr;
+    }
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, offset);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    madvise(data, size, MADV_WILLNEED);
+    return (unsigned char *)data;
+}
+#endif
+
+struct ReadRequest {
+    std::string path;
+    uint64_t fileOffset;
+    size_t rangeSize; // SIZE_MAX for the whole file
+    FileData *result;
+    std::coroutine_handle<> continuation;
+};
+
+// the reading thread is not a worker, so the continuation goes to the workers, like AssetImpl::resumeAwaiters does.
+// reading threads are exempt from the backpressure policy, so this is never blocked or rejected
+static void resumeReader(std::coroutine_handle<> continuation) {
+    bool enqueued = Job::enqueueOnWorker([continuation] () {
+        continuation.resume();
+    }, JobPriority::Background);
+    assert(enqueued);
+    (void)enqueued;
+}
+
+static FileData readBlocking(const ReadRequest &request) {
+    FileData file;
+    FILE *fp = fopen(request.path.c_str(), "rb");
+    if (!fp) {
+        return file;
+    }
+    long size = (long)request.rangeSize;
+    if (request.rangeSize == SIZE_MAX) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+    }
+    fseek(fp, (long)request.fileOffset, SEEK_SET);
+#ifdef __linux__
+    if (size > 0 && (size_t)size >= mapThreshold) {
+        file.data = mapFile(fileno(fp), request.fileOffset, size);
+        if (file.data) {
+            file.size = size;
+            file.ok = true;
+            file.mapped = true;
+            fclose(fp);
+            return file;
+        }
+    }
+#endif
+    if (size >= 0) {
+        file.data = (unsigned char *)malloc(size);
+        file.size = size;
+        file.ok = fread(file.data, 1, size, fp) == (size_t)size;
+        if (!file.ok) {
+            free(file.data);
+            file.data = nullptr;
+            file.size = 0;
+        }
+    }
+    fclose(fp);
+    return file;
+}
+
+
+#ifdef __linux__
+// what a submission is for, in the low bits of its user data. the rest points to the request, if it has one
+enum RingOp : uint8_t {
+    RING_OP_WAKE = 1, // read of the eventfd that submitting threads write to
+    RING_OP_OPEN,
+    RING_OP_STAT,
+    RING_OP_READ,
+    RING_OP_CLOSE,
+};
+
+struct RingRequest : ReadRequest {
+    int fd = -1;
+    int pendingLookups = 0; // the open and the statx (only for whole files) are submitted together
+    bool failed = false;
+    struct statx stat;
+    unsigned char *data = nullptr;
+    size_t size = 0;
+    size_t offset = 0;
+    bool mapped = false;
+};
+
+// The ring is set up with raw syscalls, since liburing isn't a dependency. Only the ring's thread touches the
+// submission and completion queues. Each file is opened and stat'ed with two submissions in the same batch, then
+// read straight into the memory handed to the reader (or mapped, if large) and closed, so a burst of loads costs a
+// handful of io_uring_enter calls instead of several syscalls per file. Registered buffers would save pinning the
+// destination pages per read, but small files would then have to be copied out of them, which costs more.
+class IoRing {
+    int ringFd = -1;
+    int wakeFd = -1;
+    io_uring_params params;
+    void *sqRing = MAP_FAILED;
+    void *cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    uint64_t wakeValue;
+
+    struct PendingOp {
+        RingRequest *request;
+        RingOp op;
+        int fd; // for closes, which outlive their request
+    };
+    std::deque<PendingOp> pendingOps; // waiting for room in the rings
+    unsigned inFlight = 0; // bounded by the completion queue size, so it can't overflow
+    unsigned unsubmitted = 0;
+    int activeRequests = 0;
+    int pendingCloses = 0;
+    std::vector<RingRequest *> finished; // in the current batch of completions
+
+    std::mutex mutex;
+    std::vector<RingRequest *> incoming;
+    bool stopping = false;
+    std::thread thread;
+
+    static int enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+    }
+
+    static int registerRing(int fd, unsigned opcode, void *arg, unsigned count) {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+    }
+
+    bool supportsOps() {
+        size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        io_uring_probe *probe = (io_uring_probe *)calloc(1, probeSize);
+        bool supported = registerRing(ringFd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+        for (int op : { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE }) {
+            supported = supported && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        }
+        free(probe);
+        return supported;
+    }
+
+    bool pushSubmission(const PendingOp &pending) {
+        unsigned tail = *sqTail; // only written by us
+        if (tail - std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire) >= params.sq_entries || inFlight >= params.cq_entries) {
+            return false;
+        }
+        unsigned index = tail & *sqMask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        RingRequest *request = pending.request;
+        switch (pending.op) {
+            case RING_OP_WAKE:
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = wakeFd;
+                sqe->addr = (uintptr_t)&wakeValue;
+                sqe->len = sizeof(wakeValue);
+                break;
+            case RING_OP_OPEN:
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uintptr_t)request->path.c_str();
+                sqe->open_flags = O_RDONLY | O_CLOEXEC;
+                break;
+            case RING_OP_STAT:
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uintptr_t)request->path.c_str();
+                sqe->len = STATX_SIZE;
+                sqe->off = (uintptr_t)&request->stat;
+                break;
+            case RING_OP_READ:
+                sqe->opcode = IORING_OP_READ;
+                sqe->addr = (uintptr_t)(request->data + request->offset);
+                sqe->fd = request->fd;
+                sqe->len = (unsigned)std::min<size_t>(request->size - request->offset, IO_MAX_READ);
+                sqe->off = request->fileOffset + request->offset;
+                break;
+            case RING_OP_CLOSE:
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = pending.fd;
+                break;
+        }
+        sqe->user_data = (uintptr_t)request | pending.op;
+        sqArray[index] = index;
+        std::atomic_ref<unsigned>(*sqTail).store(tail + 1, std::memory_order_release);
+        ++unsubmitted;
+        ++inFlight;
+        return true;
+    }
+
+    void startReading(RingRequest *request) {
+        if (request->failed || request->size == 0) {
+            finishRequest(request);
+            return;
+        }
+        // mapping doesn't wait for the disk, so it is done right here on the ring's thread
+        if (request->size >= mapThreshold && (request->data = mapFile(request->fd, request->fileOffset, request->size))) {
+            request->mapped = true;
+            finishRequest(request);
+            return;
+        }
+        request->data = (unsigned char *)malloc(request->size);
+        pendingOps.push_back({ request, RING_OP_READ, -1 });
+    }
+
+    void finishRequest(RingRequest *request) {
+        if (request->fd >= 0) {
+            pendingOps.push_back({ nullptr, RING_OP_CLOSE, request->fd });
+            ++pendingCloses;
+        }
+        FileData &file = *request->result;
+        if (request->failed) {
+            free(request->data);
+        } else {
+            file.data = request->data;
+            file.size = request->size;
+            file.ok = true;
+            file.mapped = request->mapped;
+        }
+        finished.push_back(request);
+    }
+
+    void handleCompletion(uint64_t userData, int result) {
+        RingOp op = (RingOp)(userData & 7);
+        RingRequest *request = (RingRequest *)(uintptr_t)(userData & ~(uint64_t)7);
+        switch (op) {
+            case RING_OP_WAKE:
+                pendingOps.push_front({ nullptr, RING_OP_WAKE, -1 });
+                break;
+            case RING_OP_OPEN:
+            case RING_OP_STAT:
+                if (result < 0) {
+                    request->failed = true;
+                } else if (op == RING_OP_OPEN) {
+                    request->fd = result;
+                } else {
+                    request->size = request->stat.stx_size;
+                }
+                if (--request->pendingLookups == 0) {
+                    startReading(request);
+                }
+                break;
+            case RING_OP_READ:
+                if (result == -EINTR || result == -EAGAIN) {
+                    pendingOps.push_back({ request, RING_OP_READ, -1 });
+                    break;
+                }
+                if (result <= 0) {
+                    request->failed = true; // an error, or the file got shorter
+                    finishRequest(request);
+                    break;
+                }
+                request->offset += result;
+                if (request->offset < request->size) {
+                    pendingOps.push_back({ request, RING_OP_READ, -1 });
+                } else {
+                    finishRequest(request);
+                }
+                break;
+            case RING_OP_CLOSE:
+                --pendingCloses;
+                break;
+        }
+    }
+
+    // completions are handled in batches, and the readers of a batch resumed together
+    void reapCompletions() {
+        unsigned head = *cqHead;
+        unsigned tail = std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire);
+        for (; head != tail; ++head) {
+            io_uring_cqe *cqe = &cqes[head & *cqMask];
+            --inFlight;
+            handleCompletion(cqe->user_data, cqe->res);
+        }
+        std::atomic_ref<unsigned>(*cqHead).store(head, std::memory_order_release);
+        for (RingRequest *request : finished) {
+            resumeReader(request->continuation);
+            delete request;
+        }
+        activeRequests -= (int)finished.size();
+        finished.clear();
+    }
+
+    void run() {
+        pthread_setname_np(pthread_self(), "uring");
+        pendingOps.push_back({ nullptr, RING_OP_WAKE, -1 });
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (RingRequest *request : incoming) {
+                    pendingOps.push_back({ request, RING_OP_OPEN, -1 });
+                    if (request->rangeSize == SIZE_MAX) {
+                        request->pendingLookups = 2;
+                        pendingOps.push_back({ request, RING_OP_STAT, -1 });
+                    } else {
+                        request->pendingLookups = 1;
+                        request->size = request->rangeSize;
+                    }
+                }
+                activeRequests += (int)incoming.size();
+                incoming.clear();
+                if (stopping && activeRequests == 0 && pendingCloses == 0) {
+                    break;
+                }
+            }
+            while (!pendingOps.empty() && pushSubmission(pendingOps.front())) {
+                pendingOps.pop_front();
+            }
+            // the eventfd read is always in flight, so this returns when a submitting thread writes to it
+            int submitted = enter(ringFd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+            if (submitted < 0) {
+                assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+            } else {
+                unsubmitted -= submitted;
+            }
+            reapCompletions();
+        }
+    }
+
+public:
+    // false if io_uring is unavailable, or lacks the operations used
+    bool setup() {
+        memset(&params, 0, sizeof(params));
+        ringFd = (int)syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+        if (ringFd < 0 || !supportsOps()) {
+            return false;
+        }
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) {
+                return false;
+            }
+        }
+        sqes = (io_uring_sqe *)mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        char *sq = (char *)sqRing;
+        char *cq = params.features & IORING_FEAT_SINGLE_MMAP ? sq : (char *)cqRing;
+        sqHead = (unsigned *)(sq + params.sq_off.head);
+        sqTail = (unsigned *)(sq + params.sq_off.tail);
+        sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + params.sq_off.array);
+        cqHead = (unsigned *)(cq + params.cq_off.head);
+        cqTail = (unsigned *)(cq + params.cq_off.tail);
+        cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (wakeFd < 0) {
+            return false;
+        }
+        return true;
+    }
+
+    // also cleans up after a failed setup
+    void teardown() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        }
+        if (cqRing != MAP_FAILED) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+        if (wakeFd >= 0) {
+            close(wakeFd);
+        }
+        if (ringFd >= 0) {
+            close(ringFd); // cancels the eventfd read
+        }
+    }
+
+    void start() {
+        thread = std::thread([this] {
+            JobSystem::exemptFromBackpressure();
+            run();
+        });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake();
+        thread.join();
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t written = write(wakeFd, &one, sizeof(one));
+        assert(written == sizeof(one));
+        (void)written;
+    }
+
+    void submit(RingRequest *request) {
+        bool wasEmpty;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            assert(!stopping);
+            wasEmpty = incoming.empty();
+            incoming.push_back(request);
+        }
+        if (wasEmpty) {
+            wake(); // otherwise an earlier submitter's write hasn't been serviced yet
+        }
+    }
+};
+
+static IoRing *ioRing; // null when reads are blocking jobs
+#endif
+
+
+void FileIO::start() {
+#ifdef __linux__
+    assert(!ioRing);
+    IoRing *ring = new IoRing();
+    if (ring->setup()) {
+        ring->start();
+        ioRing = ring;
+    } else {
+        ring->teardown();
+        delete ring;
+    }
+#endif
+}
+
+void FileIO::stop() {
+#ifdef __linux__
+    if (ioRing) {
+        ioRing->stop();
+        ioRing->teardown();
+        delete ioRing;
+        ioRing = nullptr;
+    }
+#endif
+}
+
+void FileIO::setMapThreshold(size_t bytes) {
+    mapThreshold = bytes;
+}
+
+void FileIO::releaseData(unsigned char *data, size_t size, bool mapped) {
+#ifdef __linux__
+    if (mapped) {
+        munmap(data, size);
+        return;
+    }
+#endif
+    free(data);
+}
+
+bool FileIO::isUsingIoUring() {
+#ifdef __linux__
+    return ioRing != nullptr;
+#else
+    return false;
+#endif
+}
+
+void FileIO::submitRead(const std::string &path, uint64_t offset, size_t size, FileData *result, std::coroutine_handle<> continuation) {
+#ifdef __linux__
+    if (ioRing) {
+        RingRequest *request = new RingRequest();
+        request->path = path;
+        request->fileOffset = offset;
+        request->rangeSize = size;
+        request->result = result;
+        request->continuation = continuation;
+        ioRing->submit(request);
+        return;
+    }
+#endif
+    // external jobs are moved around by copying their bytes, so the path is not captured by value
+    ReadRequest *request = new ReadRequest { path, offset, size, result, continuation };
+    bool enqueued = Job::enqueueBlocking([request] () {
+        *request->result = readBlocking(*request);
+        resumeReader(request->continuation);
+        delete request;
+    }, JobPriority::Background);
+    if (!enqueued) {
+        // rejected by the backpressure policy, so the read happens on the calling thread, which then also continues
+        *result = readBlocking(*request);
+        delete request;
+        continuation.resume();
+    }
+}
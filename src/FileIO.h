@@ -0,0 +1,50 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// contents of a whole file, owned by whoever awaited the read and freed with FileIO::releaseData. data is either
+// malloc'ed, or for large files a private read-only mapping of the file, which must then not be written to
+struct FileData {
+    unsigned char *data = nullptr;
+    size_t size = 0;
+    bool ok = false;
+    bool mapped = false;
+};
+
+// Asynchronous whole-file reads for the asset loader. On Linux they go through an io_uring serviced by one thread,
+// which keeps many opens, stats and reads in flight at once and resumes the awaiting coroutines on the workers as
+// completions come in. Where io_uring is unavailable (older kernels, seccomp, other platforms) each read is a
+// blocking job instead.
+class FileIO {
+    static void submitRead(const std::string &path, uint64_t offset, size_t size, FileData *result, std::coroutine_handle<> continuation);
+
+public:
+    static void start(); // after JobSystem::start
+    static void stop(); // waits for reads in flight
+    static bool isUsingIoUring();
+
+    // Files of at least this size are mapped instead of read (set before start, 256 KB by default, SIZE_MAX to
+    // always read). Mapping saves the copy and lets the kernel drop clean pages under memory pressure, but the file
+    // must not be truncated while mapped. Only supported on Linux.
+    static void setMapThreshold(size_t bytes);
+    static void releaseData(unsigned char *data, size_t size, bool mapped);
+
+    // co_await FileIO::readFile(path) continues on a worker with the FileData. with a size, only that range of the
+    // file is read (like an entry of a pack file)
+    static auto readFile(std::string path, uint64_t offset = 0, size_t size = SIZE_MAX) {
+        struct Awaiter {
+            std::string path;
+            uint64_t offset;
+            size_t size;
+            FileData result;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { submitRead(path, offset, size, &result, handle); }
+            FileData await_resume() noexcept { return result; }
+        };
+        return Awaiter { std::move(path), offset, size, {} };
+    }
+};
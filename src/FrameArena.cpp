@@ -0,0 +1,189 @@
+#include "FrameArena.h"
+
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#define FRAME_ARENA_BLOCK_SIZE (256 * 1024) // including the header. larger allocations get a block of their own
+
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size; // including the header
+};
+
+// what a thread allocated in one frame. reset when the thread first allocates in a frame GENERATIONS later
+struct ArenaGeneration {
+    ArenaBlock *blocks = nullptr; // the one being bumped into first
+    char *cursor = nullptr;
+    char *end = nullptr;
+    uint64_t frame = 0;
+    size_t used = 0;
+};
+
+// only the owning thread allocates. the stats are atomics, since getStats() reads them from other threads
+struct ThreadArena {
+    char threadName[16] = {};
+    bool owned = true; // cleared when the thread exits. the entry is kept for the stats, and reused by a thread of the same name
+    std::atomic<uint64_t> frame = UINT64_MAX; // last one the thread allocated in
+    ArenaGeneration generations[FrameArena::GENERATIONS];
+    ArenaBlock *freeBlocks = nullptr; // standard sized blocks of reset generations
+    std::atomic<size_t> used = 0;
+    std::atomic<size_t> highWatermark = 0;
+    std::atomic<size_t> reserved = 0;
+    std::atomic<uint64_t> blockAllocations = 0;
+
+    void resetGeneration(ArenaGeneration &generation) {
+        while (ArenaBlock *block = generation.blocks) {
+            generation.blocks = block->next;
+            if (block->size == FRAME_ARENA_BLOCK_SIZE) {
+                block->next = freeBlocks;
+                freeBlocks = block;
+            } else {
+                reserved.fetch_sub(block->size, std::memory_order_relaxed);
+                free(block);
+            }
+        }
+        generation.cursor = nullptr;
+        generation.end = nullptr;
+        generation.used = 0;
+    }
+
+    void releaseBlocks() {
+        for (auto &generation : generations) {
+            resetGeneration(generation);
+        }
+        while (ArenaBlock *block = freeBlocks) {
+            freeBlocks = block->next;
+            free(block);
+        }
+        reserved = 0;
+        used = 0;
+        frame = UINT64_MAX;
+    }
+
+    ArenaGeneration &beginFrame(uint64_t newFrame) {
+        ArenaGeneration &generation = generations[newFrame % FrameArena::GENERATIONS];
+        // the generation is reused at least GENERATIONS frames after it was last allocated from
+        resetGeneration(generation);
+        generation.frame = newFrame;
+        frame.store(newFrame, std::memory_order_relaxed);
+        used.store(0, std::memory_order_relaxed);
+        return generation;
+    }
+
+    // continues the generation in a new block with room for the allocation
+    void addBlock(ArenaGeneration &generation, size_t size, size_t alignment) {
+        ArenaBlock *block;
+        size_t needed = sizeof(ArenaBlock) + size + alignment;
+        if (needed <= FRAME_ARENA_BLOCK_SIZE && freeBlocks) {
+            block = freeBlocks;
+            freeBlocks = block->next;
+        } else {
+            size_t blockSize = std::max<size_t>(needed, FRAME_ARENA_BLOCK_SIZE);
+            block = static_cast<ArenaBlock *>(malloc(blockSize));
+            assert(block);
+            block->size = blockSize;
+            reserved.fetch_add(blockSize, std::memory_order_relaxed);
+            blockAllocations.fetch_add(1, std::memory_order_relaxed);
+        }
+        block->next = generation.blocks;
+        generation.blocks = block;
+        generation.cursor = reinterpret_cast<char *>(block + 1);
+        generation.end = reinterpret_cast<char *>(block) + block->size;
+    }
+};
+
+static std::atomic<uint64_t> currentFrame;
+static std::mutex arenasMutex;
+static std::vector<std::unique_ptr<ThreadArena>> arenas; // never shrinks, so entries stay valid for getStats()
+
+static ThreadArena *registerArena() {
+    char threadName[16] = "?";
+#ifdef __linux__
+    pthread_getname_np(pthread_self(), threadName, sizeof(threadName));
+#endif
+    std::lock_guard<std::mutex> lock(arenasMutex);
+    for (auto &arena : arenas) {
+        if (!arena->owned && !strcmp(arena->threadName, threadName)) {
+            arena->owned = true;
+            arena->highWatermark = 0;
+            arena->blockAllocations = 0;
+            return arena.get();
+        }
+    }
+    arenas.push_back(std::make_unique<ThreadArena>());
+    ThreadArena *arena = arenas.back().get();
+    memcpy(arena->threadName, threadName, sizeof(threadName));
+    return arena;
+}
+
+// releases the thread's blocks when it exits
+struct ThreadArenaHolder {
+    ThreadArena *arena = nullptr;
+
+    ~ThreadArenaHolder() {
+        if (arena) {
+            std::lock_guard<std::mutex> lock(arenasMutex);
+            arena->releaseBlocks();
+            arena->owned = false;
+        }
+    }
+};
+
+static thread_local ThreadArenaHolder threadArena;
+
+
+void *FrameArena::allocate(size_t size, size_t alignment) {
+    assert(alignment && (alignment & (alignment - 1)) == 0);
+    ThreadArena *arena = threadArena.arena;
+    if (!arena) {
+        arena = threadArena.arena = registerArena();
+    }
+    uint64_t frame = currentFrame.load(std::memory_order_acquire);
+    ArenaGeneration &generation = arena->frame.load(std::memory_order_relaxed) == frame ? arena->generations[frame % GENERATIONS] : arena->beginFrame(frame);
+
+    uintptr_t p = (reinterpret_cast<uintptr_t>(generation.cursor) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (!generation.cursor || p + size > reinterpret_cast<uintptr_t>(generation.end)) {
+        arena->addBlock(generation, size, alignment);
+        p = (reinterpret_cast<uintptr_t>(generation.cursor) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    }
+    generation.cursor = reinterpret_cast<char *>(p + size);
+    generation.used += size;
+    arena->used.store(generation.used, std::memory_order_relaxed);
+    if (generation.used > arena->highWatermark.load(std::memory_order_relaxed)) {
+        arena->highWatermark.store(generation.used, std::memory_order_relaxed);
+    }
+    return reinterpret_cast<void *>(p);
+}
+
+void FrameArena::beginFrame() {
+    currentFrame.fetch_add(1, std::memory_order_release);
+}
+
+uint64_t FrameArena::getFrame() {
+    return currentFrame.load(std::memory_order_relaxed);
+}
+
+std::vector<FrameArenaStats> FrameArena::getStats() {
+    std::lock_guard<std::mutex> lock(arenasMutex);
+    std::vector<FrameArenaStats> stats;
+    for (auto &arena : arenas) {
+        FrameArenaStats entry;
+        memcpy(entry.threadName, arena->threadName, sizeof(entry.threadName));
+        entry.used = arena->frame == getFrame() ? arena->used.load(std::memory_order_relaxed) : 0;
+        entry.highWatermark = arena->highWatermark;
+        entry.reserved = arena->reserved;
+        entry.blockAllocations = arena->blockAllocations;
+        stats.push_back(entry);
+    }
+    return stats;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct FrameArenaStats {
+    char threadName[16];
+    size_t used;          // in the thread's current frame
+    size_t highWatermark; // most used in a single frame
+    size_t reserved;      // in blocks held by the thread, including those kept for reuse
+    uint64_t blockAllocations; // mallocs of blocks. after warm-up this should stay constant from frame to frame
+};
+
+// Per-thread bump allocator for temporaries of a frame, like sort keys or culling results. There is no free:
+// memory allocated during a frame stays valid until beginFrame() has been called GENERATIONS (3) more
+// times, so jobs may keep using it while the next couple of frames are processed. After that, the thread's arena for
+// that generation is reset as a whole, the first time the thread allocates in the frame that reuses it.
+class FrameArena {
+public:
+    enum { GENERATIONS = 3 };
+
+    static void *allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+    template <typename T>
+    static T *allocate(size_t count) {
+        return static_cast<T *>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    static void beginFrame(); // called by the main loop at the start of each frame
+    static uint64_t getFrame();
+    static std::vector<FrameArenaStats> getStats(); // one entry per thread that has allocated
+};
+
+// for standard containers whose contents only live for the frame, like FrameVector
+template <typename T>
+struct FrameAllocator {
+    using value_type = T;
+
+    FrameAllocator() noexcept = default;
+    template <typename U>
+    FrameAllocator(const FrameAllocator<U> &) noexcept { }
+
+    T *allocate(size_t count) {
+        return FrameArena::allocate<T>(count);
+    }
+
+    void deallocate(T *, size_t) noexcept { } // freed with the frame's generation
+
+    template <typename U>
+    bool operator==(const FrameAllocator<U> &) const noexcept { return true; }
+};
+
+template <typename T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
@@ -1,14 +1,25 @@
 #include "JobSystem.h"
+#include "CpuTopology.h"
 
 #include "wsq.hpp"
-#include "MPMCQueue.h"
 #include <thread>
 #include <mutex>
-#include <chrono>
+#include <memory>
 #include <cstdio>
 #include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <xmmintrin.h> // for _mm_pause
 
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JOB_FIBERS_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define JOB_FIBERS_SUPPORTED 0
+#endif
+
 #define LOG_DEBUG(...)
 #define SET_THREAD_NAME(name) pthread_setname_np(pthread_self(), name)
 #define PAUSE() _mm_pause()
@@ -21,29 +32,755 @@
 #endif
 
 
-typedef WorkStealingQueue<Job> JobQueue;
-typedef rigtorp::MPMCQueue<Job> ExternalJobQueue;
+#define JOB_CHUNK_SIZE (64 * 1024)
+#define PAYLOAD_CHUNK_SIZE (64 * 1024)
+#define PAYLOAD_MIN_BLOCK_SHIFT 7 // smallest payload block is 128 bytes (including header)
+#define PAYLOAD_SIZE_CLASSES 6 // 128 bytes to 4 KB
+#define SPINS_BEFORE_PARKING 1000
+#define STEAL_BATCH_SIZE 16 // most jobs taken from another thread's queue at a time
+#define EXTERNAL_SEGMENT_JOBS 256 // jobs per segment of an external queue (16 KB)
+#define EXTERNAL_BATCH_SIZE 16 // jobs a worker takes from an external queue at a time
+#define FIBER_STACK_SIZE (256 * 1024) // including a guard page
+#define DEFAULT_BLOCKING_THREADS 2
+#define DURATION_TABLE_SIZE 4096 // call sites whose job durations are learned, must be a power of two
+#define DURATION_TABLE_PROBES 8
+#define TRACE_BUFFER_EVENTS (64 * 1024) // per thread, must be a power of two
+#define ELASTIC_INTERVAL_NS 5000000 // how often the active worker count is reevaluated (5 ms)
+#define ELASTIC_CHECK_JOBS 16 // jobs a busy worker runs between looks at the clock
+#define ELASTIC_GROW_IDLE 0.1 // grow while there is a backlog and active workers were idle less than this
+#define ELASTIC_SHRINK_IDLE 0.5 // shrink when active workers were idle more than this on average
+#define ELASTIC_SHRINK_INTERVALS 10 // evaluations between shrinking by one, so a gap between frames doesn't do it
+
+
+// the deques hold pointers into per-thread job pools, so that slot accesses are plain lock-free atomics
+// (std::atomic<Job> is 64 bytes, which would go through libatomic's lock table on every push/pop/steal)
+typedef WorkStealingQueue<Job *> JobQueue;
+
+static_assert(std::atomic<Job *>::is_always_lock_free);
+
+// Lets idle workers block until there is new work, without putting a lock on the enqueue path (the eventcount pattern).
+// A worker announces that it's about to park, checks all queues once more, and only then blocks, so a job enqueued
+// in between is never missed. Blocking is done with std::atomic::wait, which is a futex wait on Linux.
+class EventCount {
+    std::atomic<uint32_t> epoch = 0;
+    std::atomic<int> waiters = 0;
+
+public:
+    uint32_t prepareWait() {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        return epoch.load(std::memory_order_seq_cst);
+    }
+
+    void cancelWait() {
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wait(uint32_t key) {
+        epoch.wait(key, std::memory_order_seq_cst);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // wakes one parked thread (if any). called after making one new job available
+    void notifyOne() {
+        std::atomic_thread_fence(std::memory_order_seq_cst); // order the job push before the waiters check
+        if (waiters.load(std::memory_order_relaxed) > 0) {
+            epoch.fetch_add(1, std::memory_order_seq_cst);
+            epoch.notify_one();
+        }
+    }
+
+    void notifyAll() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) > 0) {
+            epoch.fetch_add(1, std::memory_order_seq_cst);
+            epoch.notify_all();
+        }
+    }
+};
+
+
+// Unbounded multi-producer multi-consumer queue for jobs enqueued from outside the job system (or for the main thread).
+// Jobs are stored by value in fixed-size segments, which are recycled through a free list, so steady-state pushing
+// doesn't allocate. The segment list is guarded by a lock, which is held only for a copy, and consumers take jobs in
+// batches. The depth is kept in an atomic, so polling an empty queue never touches the lock.
+class ExternalJobQueue {
+    struct Segment {
+        Segment *next;
+        int begin; // next job to pop
+        int end;   // next free slot
+        Job jobs[EXTERNAL_SEGMENT_JOBS];
+        uint32_t costs[EXTERNAL_SEGMENT_JOBS]; // hints in microseconds, 0 if unknown
+    };
+
+    std::mutex mutex;
+    Segment *head = nullptr; // popped from
+    Segment *tail = nullptr; // pushed to
+    Segment *freeSegments = nullptr;
+    size_t peakDepth = 0;
+    std::atomic<size_t> depth = 0;
+
+public:
+    ExternalJobQueue() = default;
+    ExternalJobQueue(const ExternalJobQueue&) = delete;
+    ExternalJobQueue& operator=(const ExternalJobQueue&) = delete;
+
+    ~ExternalJobQueue() {
+        for (Segment *list : { head, freeSegments }) {
+            while (list) {
+                Segment *next = list->next;
+                delete list;
+                list = next;
+            }
+        }
+    }
+
+    void push(const Job &job, uint32_t cost = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!tail || tail->end == EXTERNAL_SEGMENT_JOBS) {
+            Segment *segment = freeSegments;
+            if (segment) {
+                freeSegments = segment->next;
+            } else {
+                segment = new Segment;
+            }
+            segment->next = nullptr;
+            segment->begin = 0;
+            segment->end = 0;
+            if (tail) {
+                tail->next = segment;
+            } else {
+                head = segment;
+            }
+            tail = segment;
+        }
+        tail->costs[tail->end] = cost;
+        tail->jobs[tail->end++] = job;
+        size_t newDepth = depth.fetch_add(1, std::memory_order_release) + 1;
+        peakDepth = std::max(peakDepth, newDepth);
+    }
+
+    // pops up to maxCount jobs, in the order they were pushed
+    int popBatch(Job *jobs, int maxCount) {
+        if (empty()) {
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        int count = 0;
+        while (head && count < maxCount) {
+            int n = std::min(head->end - head->begin, maxCount - count);
+            std::copy(head->jobs + head->begin, head->jobs + head->begin + n, jobs + count);
+            head->begin += n;
+            count += n;
+            if (head->begin == head->end) {
+                if (head == tail) {
+                    head->begin = head->end = 0; // keep the last segment around, it's reused by the next push
+                    break;
+                }
+                Segment *segment = head;
+                head = segment->next;
+                segment->next = freeSegments;
+                freeSegments = segment;
+            }
+        }
+        if (count) {
+            depth.fetch_sub(count, std::memory_order_seq_cst); // ordered before the check for blocked producers
+        }
+        return count;
+    }
+
+    // pops the oldest job, unless its cost hint is more than maxCost
+    bool popIfCheaper(Job &job, uint32_t maxCost) {
+        if (empty()) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!head || head->begin == head->end || head->costs[head->begin] > maxCost) {
+            return false;
+        }
+        job = head->jobs[head->begin++];
+        if (head->begin == head->end) {
+            if (head == tail) {
+                head->begin = head->end = 0;
+            } else {
+                Segment *segment = head;
+                head = segment->next;
+                segment->next = freeSegments;
+                freeSegments = segment;
+            }
+        }
+        depth.fetch_sub(1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    bool empty() const {
+        return depth.load(std::memory_order_acquire) == 0;
+    }
+
+    size_t size() const {
+        return depth.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<size_t> &getDepth() {
+        return depth;
+    }
+
+    size_t getPeakDepth() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return peakDepth;
+    }
+};
+
 
 static std::atomic<bool> workersShouldStop;
+static std::atomic<int> stoppingWorkers; // workers that haven't finished their last job yet, while stopping
+static EventCount workerEvent; // parked workers wait on this
 static int workerCount;
-static JobQueue *workerQueues;
+static JobQueue *workerQueues; // JOB_PRIORITY_COUNT consecutive queues per worker
+static JobQueue *workerLongQueues; // likewise, for jobs predicted to be long
 static std::vector<std::thread> workerThreads;
-static JobQueue mainQueue; // belonging to the main thread
-static ExternalJobQueue externalMainQueue(16384);
-static ExternalJobQueue externalWorkerQueue(16384);
+static JobQueue mainQueues[JOB_PRIORITY_COUNT]; // belonging to the main thread
+static JobQueue mainLongQueues[JOB_PRIORITY_COUNT];
+static ExternalJobQueue externalMainQueue;
+static ExternalJobQueue externalWorkerQueues[JOB_PRIORITY_COUNT];
+static int blockingThreadCount = DEFAULT_BLOCKING_THREADS;
+static std::vector<std::thread> blockingThreads; // thread indices follow the main thread's
+static ExternalJobQueue blockingQueues[JOB_PRIORITY_COUNT];
+static EventCount blockingEvent; // idle blocking threads wait on this
+static std::atomic<bool> blockingShouldStop;
+static thread_local bool isJobSystemThread; // separate from the thread context, so checking it doesn't construct one
+static thread_local bool isBackpressureExempt; // see JobSystem::exemptFromBackpressure
+static size_t externalQueueLimit = SIZE_MAX; // per queue
+static JobBackpressure externalQueuePolicy = JobBackpressure::Grow;
+static std::atomic<int> blockedProducers; // threads waiting for an external queue to drain below the limit
+static std::atomic<uint64_t> externalOverLimitPushes;
+static std::atomic<uint64_t> externalBlockedPushes;
+static std::atomic<uint64_t> externalRejectedPushes;
+static uint64_t mainJobBudget; // nanoseconds of main thread jobs per frame, 0 for no limit
+static uint64_t mainJobFrameTime; // spent on main thread jobs since beginFrame()
+static int mainJobFrameCount; // jobs run since beginFrame()
+static MainJobStats mainJobStats;
+
+static void releaseBlockedProducers(ExternalJobQueue &queue) {
+    if (blockedProducers.load()) {
+        queue.getDepth().notify_all();
+    }
+}
+static std::atomic<uint64_t> jobChunkAllocations;
+static std::atomic<uint64_t> payloadChunkAllocations;
+static std::atomic<uint64_t> payloadHeapAllocations;
+static std::atomic<uint64_t> fiberAllocations;
+static bool fiberMode;
+static int reservedCpuCount;
+static std::vector<int> reservedCpus; // kept free of workers, if the topology is known
+
+// Elastic worker count. Workers with an index below activeWorkerCount take part in the scheduling. The others are
+// dormant: they finish what is their own and sleep on dormantEvent, so the set shrinks from the highest index
+// (the SMT siblings, see placeThreads). Without elastic workers all workers are active.
+static std::atomic<int> activeWorkerCount;
+static std::atomic<bool> elasticEnabled;
+static int elasticMin; // as set with setElasticWorkers, clamped to the worker count when applied
+static int elasticMax;
+static EventCount dormantEvent;
+static std::mutex elasticMutex; // held by the thread doing an evaluation
+static std::atomic<uint64_t> elasticIdleNanos; // of idle periods of active workers that ended since the last evaluation
+static std::atomic<uint64_t> lastElasticEvaluation;
+static uint64_t elasticOngoingIdle; // part of the idle periods still going on at the last evaluation
+static double elasticIdleAverage;
+static int elasticShrinkCountdown;
+
+// Duration learning. With it enabled, the run time of every job is folded into a moving average for its invoker
+// (which is distinct per call site, since each lambda type gets its own). Jobs predicted to take at least
+// longJobNanos are pushed to a separate long queue of the thread, which it and thieves look at before the regular
+// ones, so the long jobs of a scope start first and the scope doesn't wait on one that was picked up last.
+struct DurationEntry {
+    std::atomic<const void *> invoker = nullptr;
+    std::atomic<uint32_t> averageNanos = 0;
+};
+
+static std::atomic<bool> durationLearning;
+static uint32_t longJobNanos;
+static DurationEntry durationTable[DURATION_TABLE_SIZE]; // open addressing. entries are never removed
+static std::atomic<int> longJobsQueued; // so the long queues aren't looked at while they are all empty
+
+static DurationEntry *findDurationEntry(const void *invoker, bool insert) {
+    size_t hash = (reinterpret_cast<uintptr_t>(invoker) >> 4) * 0x9e3779b97f4a7c15ull;
+    size_t index = hash >> (64 - 12);
+    static_assert(DURATION_TABLE_SIZE == 1 << 12);
+    for (int i = 0; i < DURATION_TABLE_PROBES; ++i) {
+        DurationEntry &entry = durationTable[(index + i) & (DURATION_TABLE_SIZE - 1)];
+        const void *key = entry.invoker.load(std::memory_order_acquire);
+        if (key == invoker) {
+            return &entry;
+        }
+        if (!key) {
+            if (!insert) {
+                return nullptr;
+            }
+            if (entry.invoker.compare_exchange_strong(key, invoker) || key == invoker) {
+                return &entry;
+            }
+        }
+    }
+    return nullptr; // too many collisions, not learned
+}
+
+// races between threads updating the same entry only lose a sample
+static void learnDuration(const void *invoker, uint64_t nanos) {
+    if (DurationEntry *entry = findDurationEntry(invoker, true)) {
+        int64_t average = entry->averageNanos.load(std::memory_order_relaxed);
+        int64_t sample = std::min<uint64_t>(nanos, UINT32_MAX);
+        average = average ? average + (sample - average) / 8 : sample;
+        entry->averageNanos.store((uint32_t)average, std::memory_order_relaxed);
+    }
+}
+
+static bool isPredictedLong(const void *invoker) {
+    DurationEntry *entry = findDurationEntry(invoker, false);
+    return entry && entry->averageNanos.load(std::memory_order_relaxed) >= longJobNanos;
+}
+
+static uint64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Where a thread runs, and in which order it looks at the other threads when stealing. Threads are indexed with the
+// workers first and the main thread last. Victims are grouped in tiers of increasing distance (SMT sibling, same last
+// level cache, same package, remote), so stolen jobs tend to find their data in a shared cache, and a steal only
+// crosses to another L3 or socket when nothing closer has work.
+enum {
+    STEAL_STAT_EXTERNAL = 4, // after the CpuDistance values
+    STEAL_STAT_CONTENDED,
+};
+
+struct alignas(64) ThreadPlacement {
+    int cpu = -1; // pinned CPU, or -1 if not pinned
+    std::vector<int> victims; // other worker indices, nearest tier first
+    int tierEnds[4] = {}; // end of each tier in victims
+    int mainDistance = (int)CpuDistance::Remote;
+    std::atomic<uint64_t> steals[6] = {}; // per CpuDistance, then STEAL_STAT_EXTERNAL and STEAL_STAT_CONTENDED
+    std::atomic<uint64_t> idleSince = 0; // start of the current idle period of an active worker, with elastic workers
+};
+
+static std::vector<ThreadPlacement> threadPlacements; // workerCount + 1 entries, kept after stop() for the stats
+
+
+enum class TraceEventType : uint32_t {
+    Job,     // detail is the TraceSource
+    Idle,    // worker with nothing to do. detail is 1 if it parked
+    Wait,    // thread in JobScope::dispatch with nothing to do, while jobs of the scope run elsewhere
+    Instant, // marker from JobSystem::traceInstant
+};
+
+enum TraceSource : uint32_t {
+    TRACE_SOURCE_OWN,
+    TRACE_SOURCE_MAIN,
+    TRACE_SOURCE_WORKER,
+    TRACE_SOURCE_EXTERNAL,
+    TRACE_SOURCE_BLOCKING,
+};
+
+struct TraceEvent {
+    uint64_t begin; // nanoseconds since the trace epoch
+    uint64_t end;
+    const void *object; // scope for job and wait events, name for instant events, invoker for jobs
+    const void *invoker;
+    TraceEventType type;
+    uint32_t detail;
+};
+
+static std::atomic<bool> tracingEnabled;
+
+// Ring buffer of trace events written by a single thread. When it's full the oldest events are overwritten.
+// Buffers are indexed by thread index, and kept across stop() and start(), so the trace can be written afterwards
+struct TraceBuffer {
+    std::atomic<uint64_t> count = 0;
+    std::atomic<bool> adding = false; // while the owner is in add()
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+
+    // a thread may fetch its buffer before a job, and add the job's event after tracing has been disabled. such
+    // events are dropped, and waitForTraceWriters() waits for adds that saw tracing still enabled. both flags are
+    // sequentially consistent, so one side always sees the other's
+    void add(const TraceEvent &event) {
+        adding.store(true);
+        if (tracingEnabled.load()) {
+            uint64_t n = count.load(std::memory_order_relaxed);
+            events[n & (TRACE_BUFFER_EVENTS - 1)] = event;
+            count.store(n + 1, std::memory_order_release);
+        }
+        adding.store(false, std::memory_order_release);
+    }
+};
+
+static std::vector<std::unique_ptr<TraceBuffer>> traceBuffers; // only resized in start(), before the workers are running
+static std::chrono::steady_clock::time_point traceEpoch;
+
+static uint64_t traceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+// called with tracing disabled. afterwards no thread writes to the buffers until it is enabled again
+static void waitForTraceWriters() {
+    for (auto &buffer : traceBuffers) {
+        while (buffer && buffer->adding.load()) {
+            PAUSE();
+        }
+    }
+}
+
+static void allocateTraceBuffers() {
+    for (auto &buffer : traceBuffers) {
+        if (!buffer) {
+            buffer = std::make_unique<TraceBuffer>();
+        }
+    }
+}
+
+
+// Job slots owned by a single thread. Only the owner allocates, but any thread may release a slot after running
+// the job. Slots are carved out of chunks aligned to their own size, so the owner of a slot is found by masking its address.
+class JobPool {
+    struct alignas(64) ChunkHeader {
+        JobPool *owner;
+    };
+
+    enum { JOBS_PER_CHUNK = (JOB_CHUNK_SIZE - sizeof(ChunkHeader)) / sizeof(Job) };
+
+    Job *freeList = nullptr; // only accessed by the owning thread
+    alignas(64) std::atomic<Job *> remoteFreeList = nullptr; // slots released by other threads
+    std::vector<void *> chunks;
+
+    void allocateChunk() {
+        void *chunk = std::aligned_alloc(JOB_CHUNK_SIZE, JOB_CHUNK_SIZE);
+        assert(chunk);
+        ++jobChunkAllocations;
+        chunks.push_back(chunk);
+        static_cast<ChunkHeader *>(chunk)->owner = this;
+        Job *jobs = reinterpret_cast<Job *>(static_cast<char *>(chunk) + sizeof(ChunkHeader));
+        for (int i = 0; i < JOBS_PER_CHUNK; ++i) {
+            jobs[i].nextFree = freeList;
+            freeList = &jobs[i];
+        }
+    }
+
+    static JobPool *getOwner(Job *job) {
+        return reinterpret_cast<ChunkHeader *>(reinterpret_cast<uintptr_t>(job) & ~uintptr_t(JOB_CHUNK_SIZE - 1))->owner;
+    }
+
+public:
+    JobPool() = default;
+    JobPool(const JobPool&) = delete;
+    JobPool& operator=(const JobPool&) = delete;
+
+    ~JobPool() {
+        for (void *chunk : chunks) {
+            std::free(chunk);
+        }
+    }
+
+    Job *allocate() {
+        if (!freeList) {
+            // take back everything other threads have released in one go (no ABA, since we never pop single items)
+            freeList = remoteFreeList.exchange(nullptr, std::memory_order_acquire);
+            if (!freeList) {
+                allocateChunk();
+            }
+        }
+        Job *job = freeList;
+        freeList = job->nextFree;
+        return job;
+    }
+
+    // must be called on the thread owning this pool
+    void release(Job *job) {
+        JobPool *owner = getOwner(job);
+        if (owner == this) {
+            job->nextFree = freeList;
+            freeList = job;
+        } else {
+            Job *head = owner->remoteFreeList.load(std::memory_order_relaxed);
+            do {
+                job->nextFree = head;
+            } while (!owner->remoteFreeList.compare_exchange_weak(head, job, std::memory_order_release, std::memory_order_relaxed));
+        }
+    }
+};
+
+
+// Storage for job captures too large to fit inline in a Job. Power-of-two size classes carved out of per-thread slabs,
+// which are kept for the lifetime of the thread, so steady-state enqueueing never hits malloc. Like job slots, blocks
+// may be released from any thread, and are handed back to the owning pool.
+class PayloadPool {
+    struct alignas(std::max_align_t) BlockHeader {
+        PayloadPool *owner; // null for heap allocated payloads
+        int sizeClass;
+        BlockHeader *nextFree;
+    };
+
+    BlockHeader *freeLists[PAYLOAD_SIZE_CLASSES] = {}; // only accessed by the owning thread
+    alignas(64) std::atomic<BlockHeader *> remoteFreeLists[PAYLOAD_SIZE_CLASSES] = {}; // blocks released by other threads
+    std::vector<void *> chunks;
+
+    void allocateChunk(int sizeClass) {
+        void *chunk = std::malloc(PAYLOAD_CHUNK_SIZE);
+        assert(chunk);
+        ++payloadChunkAllocations;
+        chunks.push_back(chunk);
+        size_t blockSize = size_t(1) << (sizeClass + PAYLOAD_MIN_BLOCK_SHIFT);
+        for (size_t offset = 0; offset + blockSize <= PAYLOAD_CHUNK_SIZE; offset += blockSize) {
+            BlockHeader *block = reinterpret_cast<BlockHeader *>(static_cast<char *>(chunk) + offset);
+            block->owner = this;
+            block->sizeClass = sizeClass;
+            block->nextFree = freeLists[sizeClass];
+            freeLists[sizeClass] = block;
+        }
+    }
+
+public:
+    PayloadPool() = default;
+    PayloadPool(const PayloadPool&) = delete;
+    PayloadPool& operator=(const PayloadPool&) = delete;
+
+    ~PayloadPool() {
+        for (void *chunk : chunks) {
+            std::free(chunk);
+        }
+    }
+
+    static void *allocateFromHeap(size_t size) {
+        BlockHeader *block = static_cast<BlockHeader *>(std::malloc(sizeof(BlockHeader) + size));
+        assert(block);
+        ++payloadHeapAllocations;
+        block->owner = nullptr;
+        return block + 1;
+    }
+
+    void *allocate(size_t size) {
+        int sizeClass = 0;
+        while ((size_t(1) << (sizeClass + PAYLOAD_MIN_BLOCK_SHIFT)) < sizeof(BlockHeader) + size) {
+            ++sizeClass;
+        }
+        if (sizeClass >= PAYLOAD_SIZE_CLASSES) {
+            return allocateFromHeap(size);
+        }
+        if (!freeLists[sizeClass]) {
+            freeLists[sizeClass] = remoteFreeLists[sizeClass].exchange(nullptr, std::memory_order_acquire);
+            if (!freeLists[sizeClass]) {
+                allocateChunk(sizeClass);
+            }
+        }
+        BlockHeader *block = freeLists[sizeClass];
+        freeLists[sizeClass] = block->nextFree;
+        return block + 1;
+    }
+
+    // must be called on the thread owning this pool
+    void release(void *payload) {
+        BlockHeader *block = static_cast<BlockHeader *>(payload) - 1;
+        PayloadPool *owner = block->owner;
+        if (!owner) {
+            std::free(block);
+        } else if (owner == this) {
+            block->nextFree = freeLists[block->sizeClass];
+            freeLists[block->sizeClass] = block;
+        } else {
+            std::atomic<BlockHeader *> &list = owner->remoteFreeLists[block->sizeClass];
+            BlockHeader *head = list.load(std::memory_order_relaxed);
+            do {
+                block->nextFree = head;
+            } while (!list.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+        }
+    }
+};
+
+
+#if JOB_FIBERS_SUPPORTED
+// saves the callee-saved registers and the SSE/x87 control words on the current stack, stores the stack pointer
+// in *from, then switches to the stack at to and restores what was saved there
+extern "C" void jobFiberSwitch(void **from, void *to);
+asm(R"(
+    .text
+    .p2align 4
+    .globl jobFiberSwitch
+    .type jobFiberSwitch, @function
+jobFiberSwitch:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size jobFiberSwitch, .-jobFiberSwitch
+)");
+#endif
+
+// A stack that a worker runs its scheduling loop and jobs on, in fiber mode. Fibers never move between threads.
+class JobFiber {
+public:
+    void *stackPointer = nullptr; // saved context while not running
+    char *stack = nullptr;
+    ThreadContext *owner = nullptr;
+    JobScope *activeScope = nullptr; // active scope of the thread while this fiber last ran
+    CancellationToken *runningToken = nullptr; // likewise for the token of the running job
+    JobScope *runningBaseScope = nullptr; // and its base scope and priority
+    JobPriority runningPriority = JobPriority::Normal;
+    JobFiber *next = nullptr; // in the owner's free or ready list
+
+    JobFiber(ThreadContext *owner, JobScope *activeScope, void (*entry)()) : owner(owner), activeScope(activeScope) {
+#if JOB_FIBERS_SUPPORTED
+        stack = static_cast<char *>(mmap(nullptr, FIBER_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0));
+        assert(stack != MAP_FAILED);
+        mprotect(stack, 4096, PROT_NONE); // guard page, so an overflow crashes instead of corrupting memory
+        ++fiberAllocations;
+        // lay out the stack like jobFiberSwitch left it, so that switching to it "returns" into entry
+        uint64_t *sp = reinterpret_cast<uint64_t *>(stack + FIBER_STACK_SIZE);
+        *--sp = 0; // return address of entry, which never returns
+        *--sp = reinterpret_cast<uint64_t>(entry);
+        for (int i = 0; i < 6; ++i) {
+            *--sp = 0; // rbp, rbx, r12-r15
+        }
+        *--sp = 0x037F00001F80ull; // default x87 control word and MXCSR
+        stackPointer = sp;
+#else
+        (void)entry;
+#endif
+    }
+
+    ~JobFiber() {
+#if JOB_FIBERS_SUPPORTED
+        munmap(stack, FIBER_STACK_SIZE);
+#endif
+    }
+};
+
+static void fiberMain();
+
+
+static size_t countQueuedJobs() {
+    size_t count = 0;
+    for (int i = 0; i < workerCount * JOB_PRIORITY_COUNT; ++i) {
+        count += workerQueues[i].size() + workerLongQueues[i].size();
+    }
+    for (int i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+        count += mainQueues[i].size() + mainLongQueues[i].size() + externalWorkerQueues[i].size();
+    }
+    return count;
+}
+
+static void applyElasticWorkers() {
+    int minWorkers = std::clamp(elasticMin, 1, workerCount);
+    int maxWorkers = elasticMax > 0 ? std::clamp(elasticMax, minWorkers, workerCount) : workerCount;
+    int active = activeWorkerCount.load();
+    if (elasticMin <= 0) {
+        elasticEnabled = false;
+        activeWorkerCount = workerCount;
+    } else {
+        elasticEnabled = true;
+        activeWorkerCount = std::clamp(active, minWorkers, maxWorkers);
+    }
+    if (activeWorkerCount > active) {
+        dormantEvent.notifyAll();
+    }
+}
+
+// called by active workers every few jobs, and when they become idle or busy. at most one evaluation per interval:
+// the active set grows by half of what is left while there is a backlog that the active workers are too busy to
+// take on, and shrinks by one per ELASTIC_SHRINK_INTERVALS while they are idle much of the time. a long quiet period
+// (with every worker parked, so no evaluations) counts as all the intervals it spans
+static void updateActiveWorkers(uint64_t now) {
+    uint64_t last = lastElasticEvaluation.load(std::memory_order_relaxed);
+    if (now - last < ELASTIC_INTERVAL_NS || !elasticMutex.try_lock()) {
+        return;
+    }
+    last = lastElasticEvaluation.load(std::memory_order_relaxed);
+    if (now - last >= ELASTIC_INTERVAL_NS) {
+        lastElasticEvaluation.store(now, std::memory_order_relaxed);
+        int minWorkers = std::clamp(elasticMin, 1, workerCount);
+        int maxWorkers = elasticMax > 0 ? std::clamp(elasticMax, minWorkers, workerCount) : workerCount;
+        int active = activeWorkerCount.load(std::memory_order_relaxed);
+        uint64_t ongoingIdle = 0;
+        for (int i = 0; i < active; ++i) {
+            uint64_t since = threadPlacements[i].idleSince.load(std::memory_order_relaxed);
+            if (since && since < now) {
+                ongoingIdle += now - since;
+            }
+        }
+        double idleNanos = (double)elasticIdleNanos.exchange(0, std::memory_order_relaxed) + (double)ongoingIdle - (double)elasticOngoingIdle;
+        elasticOngoingIdle = ongoingIdle;
+        double idle = std::clamp(idleNanos / ((double)(now - last) * active), 0.0, 1.0);
+        int intervals = (int)std::min<uint64_t>((now - last) / ELASTIC_INTERVAL_NS, 1000);
+        elasticIdleAverage += (idle - elasticIdleAverage) * (1 - std::pow(7.0 / 8.0, intervals));
+        elasticShrinkCountdown -= intervals;
+        if (idle < ELASTIC_GROW_IDLE && active < maxWorkers && countQueuedJobs() > (size_t)active) {
+            active += std::max(1, (maxWorkers - active) / 2);
+            activeWorkerCount.store(active);
+            dormantEvent.notifyAll();
+            elasticShrinkCountdown = ELASTIC_SHRINK_INTERVALS;
+        }
+        while (elasticShrinkCountdown <= 0 && elasticIdleAverage > ELASTIC_SHRINK_IDLE && active > minWorkers) {
+            activeWorkerCount.store(--active); // dormant workers notice this themselves
+            elasticShrinkCountdown += ELASTIC_SHRINK_INTERVALS;
+        }
+        elasticShrinkCountdown = std::max(elasticShrinkCountdown, 0);
+    }
+    elasticMutex.unlock();
+}
 
 
 class ThreadContext {
 public:
-    JobQueue *queue;
-    ExternalJobQueue *externalQueue;
+    JobPool jobPool;
+    PayloadPool payloadPool;
+    JobQueue *queues; // one per priority
+    JobQueue *longQueues; // one per priority, for jobs predicted to be long
+    // null where there is none to service. the main thread has none, so its jobs only run in drainMainJobs,
+    // within the frame budget
+    ExternalJobQueue *externalQueues[JOB_PRIORITY_COUNT];
     JobScope *activeScope;
     JobScope *threadScope;
+    CancellationToken *runningToken = nullptr; // of the running job, if it was enqueued with Job::cancellable
+    // the active scope when the running job started, and the priority it was queued at. while that scope is still
+    // active the job hasn't created one of its own, and what it enqueues gets its priority rather than the scope's,
+    // so the children of a background job don't run as normal ones
+    JobScope *runningBaseScope = nullptr;
+    JobPriority runningPriority = JobPriority::Normal;
+    ThreadPlacement *placement = nullptr;
+    int threadIndex = -1;
+    int lastVictim = -1; // thread index of the last thread we stole from
+    int lastVictimDistance;
+    uint64_t idleBegin = 0; // start of the current idle or wait period when tracing, else zero
+    TraceEventType idleType;
+    uint32_t idleDetail;
+    const void *idleObject;
+    uint32_t randomState = 1; // xorshift, so picking a victim doesn't go through the global lock of rand()
+    uint64_t elasticIdleBegin = 0; // start of the current idle period of an active worker, with elastic workers
+    int elasticJobCount = 0;
+    JobFiber *currentFiber = nullptr; // null when not running on a fiber
+    void *rootStackPointer; // the worker thread's own stack, while it runs fibers
+    JobFiber *freeFibers = nullptr;
+    JobFiber *localReadyFibers = nullptr;
+    alignas(64) std::atomic<JobFiber *> readyFibers = nullptr; // parked fibers whose scope has completed, pushed by any thread
+    std::vector<JobFiber *> fibers; // all created by this thread
+    int parkedFibers = 0;
     char threadName[16];
 
 #if PRINT_STATS
-    int sleepCount = 0;
-    int yieldCount = 0;
+    int parkCount = 0;
     int pauseCount = 0;
     int runOwnCount = 0;
     int stealMainCount = 0;
@@ -51,125 +788,679 @@ public:
     int bgCount = 0;
 #endif
 
-    ThreadContext() {
-        threadScope = new JobScope(this);
+    ThreadContext() {
+        threadScope = new JobScope(this);
+    }
+
+    void finish() {
+        threadScope->dispatch();
+        delete threadScope;
+        threadScope = nullptr;
+        activeScope = nullptr;
+        queues = nullptr;
+        longQueues = nullptr;
+#if PRINT_STATS
+        printf("%s   K:%d P:%d   s:%d mt:%d wt:%d bg:%d\n", threadName, parkCount, pauseCount, runOwnCount, stealMainCount, stealWorkerCount, bgCount);
+#endif
+    }
+
+    // of jobs enqueued into the scope, and of scopes created under it
+    JobPriority getPriorityIn(JobScope *scope) const {
+        return scope == runningBaseScope ? runningPriority : scope->priority;
+    }
+
+    void enqueueJob(Job *job, JobPriority priority) {
+        assert(queues);
+        job->scope = activeScope;
+        ++activeScope->pendingCount;
+        pushJob(job, priority);
+    }
+
+    void pushJob(Job *job, JobPriority priority) {
+        JobQueue *queue = &queues[(int)priority];
+        if (durationLearning.load(std::memory_order_relaxed) && isPredictedLong((const void *)job->invoker)) {
+            longJobsQueued.fetch_add(1, std::memory_order_relaxed); // before the push, so the count covers the job while it's queued
+            queue = &longQueues[(int)priority];
+        }
+        // only the push that makes the queue non-empty wakes a worker. a worker that steals wakes the next one while
+        // there is more left, so a burst wakes as many workers as it can keep busy, without a fence on every push
+        bool wasEmpty = queue->empty();
+        queue->push(job);
+        if (wasEmpty) {
+            workerEvent.notifyOne();
+        }
+    }
+
+    TraceBuffer *getTraceBuffer() {
+        if (!tracingEnabled.load(std::memory_order_acquire) || threadIndex < 0) {
+            return nullptr;
+        }
+        return traceBuffers[threadIndex].get();
+    }
+
+    void beginIdle(TraceEventType type, const void *object) {
+        if (!idleBegin && getTraceBuffer()) {
+            idleBegin = traceNow();
+            idleType = type;
+            idleDetail = 0;
+            idleObject = object;
+        }
+    }
+
+    void endIdle(uint64_t now = 0) {
+        if (idleBegin) {
+            if (TraceBuffer *buffer = getTraceBuffer()) {
+                buffer->add({ idleBegin, now ? now : traceNow(), idleObject, nullptr, idleType, idleDetail });
+            }
+            idleBegin = 0;
+        }
+    }
+
+    void runJob(Job *job, JobPriority priority, TraceSource source) {
+        endElasticIdle();
+        JobScope *scope = job->scope;
+        // the job polls its scope's token through JobSystem::isCancelled(), and scopes it creates inherit it, on
+        // whichever thread it runs
+        CancellationToken *prevToken = std::exchange(runningToken, scope ? scope->token : nullptr);
+        JobScope *prevBaseScope = std::exchange(runningBaseScope, activeScope);
+        JobPriority prevPriority = std::exchange(runningPriority, priority);
+        TraceBuffer *buffer = getTraceBuffer();
+        if (buffer || durationLearning.load(std::memory_order_relaxed)) {
+            const void *invoker = (const void *)job->invoker;
+            uint64_t begin = traceNow();
+            endIdle(begin);
+            job->invoke();
+            uint64_t end = traceNow();
+            if (buffer) {
+                buffer->add({ begin, end, scope, invoker, TraceEventType::Job, source });
+            }
+            learnDuration(invoker, end - begin);
+        } else {
+            idleBegin = 0;
+            job->invoke();
+        }
+        runningToken = prevToken;
+        runningBaseScope = prevBaseScope;
+        runningPriority = prevPriority;
+        // release the slot before signaling the scope, so the owning thread can't finish (and free its pool) while we still hold the slot
+        jobPool.release(job);
+        if (scope) {
+            scope->decrementPending();
+        }
+    }
+
+    void beginElasticIdle() {
+        if (!elasticIdleBegin && threadIndex < workerCount && elasticEnabled.load(std::memory_order_relaxed)) {
+            elasticIdleBegin = nowNanos();
+            placement->idleSince.store(elasticIdleBegin, std::memory_order_relaxed);
+            updateActiveWorkers(elasticIdleBegin);
+        }
+    }
+
+    void endElasticIdle() {
+        if (elasticIdleBegin) {
+            uint64_t now = nowNanos();
+            placement->idleSince.store(0, std::memory_order_relaxed);
+            elasticIdleNanos.fetch_add(now - elasticIdleBegin, std::memory_order_relaxed);
+            elasticIdleBegin = 0;
+            elasticJobCount = 0;
+            updateActiveWorkers(now);
+        }
+    }
+
+    void countElasticJob() {
+        if (++elasticJobCount >= ELASTIC_CHECK_JOBS) {
+            elasticJobCount = 0;
+            if (elasticEnabled.load(std::memory_order_relaxed)) {
+                updateActiveWorkers(nowNanos());
+            }
+        }
+    }
+
+    bool isDormant() {
+        return threadIndex >= activeWorkerCount.load(std::memory_order_relaxed);
+    }
+
+    bool hasOwnJobs() {
+        for (int i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+            if (!queues[i].empty() || !longQueues[i].empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // a worker above the active count finishes what is its own (jobs left in its queues, and fibers parked on it),
+    // without stealing, and then sleeps until it is made active again
+    void runDormant() {
+        endElasticIdle();
+        workerEvent.notifyOne(); // we may have taken a wake-up meant for an active worker
+        for (;;) {
+            while (resumeReadyFiber() || popOwnJob(JobPriority::Critical) || popOwnJob(JobPriority::Normal) || popOwnJob(JobPriority::Background)) {
+            }
+            if ((workersShouldStop && !parkedFibers) || !isDormant()) {
+                return;
+            }
+            uint32_t key = dormantEvent.prepareWait();
+            if ((workersShouldStop && !parkedFibers) || !isDormant() || hasReadyFibers() || hasOwnJobs()) {
+                dormantEvent.cancelWait();
+                continue;
+            }
+            dormantEvent.wait(key);
+        }
+    }
+
+    uint32_t random() {
+        uint32_t x = randomState;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        return randomState = x;
+    }
+
+    void countSteal(int distance) {
+        placement->steals[distance].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void dispatchActiveScope() {
+        activeScope->dispatch();
+    }
+
+    // runs one job, most urgent first, so less urgent work is preempted at job granularity. critical and normal jobs
+    // are taken from the own queues before stealing, since scanning every other queue before each own job would
+    // double the overhead of tiny jobs. background jobs only run when no critical or normal job could be found
+    // anywhere. jobs less urgent than maxStealPriority are not taken from others, so a thread waiting on a
+    // frame-critical scope won't pick up a long background job
+    bool dispatchSingleJob(JobPriority maxStealPriority = JobPriority::Background) {
+        if (popOwnJob(JobPriority::Critical) || popOwnJob(JobPriority::Normal)) {
+            return true;
+        }
+        uint32_t stealStart = random();
+        if (stealSingleJob(JobPriority::Critical, stealStart)) {
+            return true;
+        }
+        if (maxStealPriority >= JobPriority::Normal && stealSingleJob(JobPriority::Normal, stealStart)) {
+            return true;
+        }
+        if (popOwnJob(JobPriority::Background)) {
+            return true;
+        }
+        return maxStealPriority >= JobPriority::Background && stealSingleJob(JobPriority::Background, stealStart);
+    }
+
+    bool popOwnJob(JobPriority priority) {
+        if (longJobsQueued.load(std::memory_order_relaxed) && popLongJob(&longQueues[(int)priority], priority)) {
+            return true;
+        }
+        // service own queue till empty
+        // (queues are checked with empty() first, which is cheap, while pop() on an empty queue still costs a fence)
+        JobQueue *queue = &queues[(int)priority];
+        if (queue->empty()) {
+            return false;
+        }
+        auto job = queue->pop();
+        if (job.has_value()) {
+            LOG_DEBUG("%s running own job\n", threadName);
+            INC_STAT(runOwnCount);
+            runJob(*job, priority, TRACE_SOURCE_OWN);
+            return true;
+        }
+        return false;
+    }
+
+    bool popLongJob(JobQueue *queue, JobPriority priority) {
+        if (queue->empty()) {
+            return false;
+        }
+        auto job = queue->pop();
+        if (!job.has_value()) {
+            return false;
+        }
+        longJobsQueued.fetch_sub(1, std::memory_order_relaxed);
+        runJob(*job, priority, TRACE_SOURCE_OWN);
+        return true;
+    }
+
+    // long jobs are stolen one at a time, since each is worth a thread on its own
+    bool stealLongJob(int victimIndex, JobPriority priority, int distance) {
+        JobQueue *victim = victimIndex == workerCount ? &mainLongQueues[(int)priority] : &workerLongQueues[victimIndex * JOB_PRIORITY_COUNT + (int)priority];
+        if (victim->empty()) {
+            return false;
+        }
+        auto job = victim->steal();
+        if (!job.has_value()) {
+            return false;
+        }
+        longJobsQueued.fetch_sub(1, std::memory_order_relaxed);
+        if (!victim->empty()) {
+            workerEvent.notifyOne();
+        }
+        countSteal(distance);
+        runJob(*job, priority, victimIndex == workerCount ? TRACE_SOURCE_MAIN : TRACE_SOURCE_WORKER);
+        return true;
+    }
+
+    bool stealSingleJob(JobPriority priority, uint32_t stealStart) {
+        // steal from main queue
+        if (queues != mainQueues) {
+            if (stealFrom(workerCount, priority, placement->mainDistance)) {
+                INC_STAT(stealMainCount);
+                return true;
+            }
+        }
+
+        // then from the worker we last stole from, since a thread with a deep queue tends to stay that way
+        if (lastVictim >= 0 && lastVictim < workerCount && stealFrom(lastVictim, priority, lastVictimDistance)) {
+            INC_STAT(stealWorkerCount);
+            return true;
+        }
+
+        // steal from other worker queues, nearest first, starting at a random victim within each tier.
+        // one extra position in the scan is dedicated to dispatching from the external queue
+        const std::vector<int> &victims = placement->victims;
+        int externalPos = stealStart % (victims.size() + 1);
+        int tierStart = 0;
+        for (int tier = 0; tier < 4; ++tier) {
+            int tierEnd = placement->tierEnds[tier];
+            int tierSize = tierEnd - tierStart;
+            for (int i = 0; i < tierSize; ++i) {
+                if (tierStart + i == externalPos && stealExternalJob(priority)) {
+                    return true;
+                }
+                int idx = victims[tierStart + (stealStart + i) % tierSize];
+                if (idx != lastVictim && stealFrom(idx, priority, tier)) {
+                    INC_STAT(stealWorkerCount);
+                    return true;
+                }
+            }
+            tierStart = tierEnd;
+        }
+        return externalPos == (int)victims.size() && stealExternalJob(priority);
+    }
+
+    // steals half of the victim's jobs (up to STEAL_BATCH_SIZE), runs the oldest and moves the rest to the own queue.
+    // after a big fan-out, idle threads then spread over the thieves' queues, instead of all fighting over the
+    // victim's top index one job at a time
+    bool stealFrom(int victimIndex, JobPriority priority, int distance) {
+        if (longJobsQueued.load(std::memory_order_relaxed) && stealLongJob(victimIndex, priority, distance)) {
+            return true;
+        }
+        JobQueue *victim = victimIndex == workerCount ? &mainQueues[(int)priority] : &workerQueues[victimIndex * JOB_PRIORITY_COUNT + (int)priority];
+        if (victim->empty()) {
+            return false;
+        }
+        Job *batch[STEAL_BATCH_SIZE];
+        size_t count = victim->steal_batch(batch, std::clamp(victim->size() / 2, size_t(1), size_t(STEAL_BATCH_SIZE)));
+        if (!count) {
+            countSteal(STEAL_STAT_CONTENDED); // lost the race for the top index to another thief (or the owner)
+            return false;
+        }
+        LOG_DEBUG("%s stealing %d from %d\n", threadName, (int)count, victimIndex);
+        for (size_t i = 1; i < count; ++i) {
+            pushJob(batch[i], priority);
+        }
+        if (!victim->empty()) {
+            workerEvent.notifyOne();
+        }
+        lastVictim = victimIndex;
+        lastVictimDistance = distance;
+        countSteal(distance);
+        runJob(batch[0], priority, victimIndex == workerCount ? TRACE_SOURCE_MAIN : TRACE_SOURCE_WORKER);
+        return true;
+    }
+
+    bool stealExternalJob(JobPriority priority) {
+        ExternalJobQueue *queue = externalQueues[(int)priority];
+        if (!queue) {
+            return false;
+        }
+        // take a batch and move the rest to the own queue, where other workers can steal them
+        Job batch[EXTERNAL_BATCH_SIZE];
+        int count = queue->popBatch(batch, EXTERNAL_BATCH_SIZE);
+        if (!count) {
+            return false;
+        }
+        releaseBlockedProducers(*queue);
+        for (int i = 1; i < count; ++i) {
+            Job *job = jobPool.allocate();
+            *job = batch[i];
+            pushJob(job, priority);
+        }
+        countSteal(STEAL_STAT_EXTERNAL);
+        runExternalJob(batch[0], priority);
+        return true;
+    }
+
+    void runExternalJob(Job &job, JobPriority priority, TraceSource source = TRACE_SOURCE_EXTERNAL) {
+        endElasticIdle();
+        JobScope *scope = job.scope;
+        CancellationToken *prevToken = std::exchange(runningToken, scope ? scope->token : nullptr);
+        JobScope *prevBaseScope = std::exchange(runningBaseScope, activeScope);
+        JobPriority prevPriority = std::exchange(runningPriority, priority);
+        TraceBuffer *buffer = getTraceBuffer();
+        if (buffer || durationLearning.load(std::memory_order_relaxed)) {
+            uint64_t begin = traceNow();
+            endIdle(begin);
+            const void *invoker = (const void *)job.invoker;
+            job.run();
+            uint64_t end = traceNow();
+            if (buffer) {
+                buffer->add({ begin, end, scope, invoker, TraceEventType::Job, source });
+            }
+            learnDuration(invoker, end - begin);
+        } else {
+            idleBegin = 0;
+            job.run();
+        }
+        runningToken = prevToken;
+        runningBaseScope = prevBaseScope;
+        runningPriority = prevPriority;
+    }
+
+    void setPlacement(int index) {
+        threadIndex = index;
+        placement = &threadPlacements[threadIndex];
+        randomState = 0x9e3779b9u * (threadIndex + 1);
+        if (placement->cpu >= 0) {
+            pinCurrentThreadToCpu(placement->cpu);
+        }
+    }
+
+    void runWorker(int workerIndex) {
+        sprintf(threadName, "worker%d", workerIndex);
+        SET_THREAD_NAME(threadName);
+        LOG_DEBUG("%s starting\n", threadName);
+        setPlacement(workerIndex);
+        isJobSystemThread = true;
+
+        queues = &workerQueues[workerIndex * JOB_PRIORITY_COUNT];
+        longQueues = &workerLongQueues[workerIndex * JOB_PRIORITY_COUNT];
+        for (int i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+            externalQueues[i] = &externalWorkerQueues[i];
+        }
+
+#if JOB_FIBERS_SUPPORTED
+        if (fiberMode) {
+            JobFiber *fiber = getFreeFiber();
+            currentFiber = fiber;
+            jobFiberSwitch(&rootStackPointer, fiber->stackPointer); // back here once the workers are stopped
+            for (JobFiber *fiber : fibers) {
+                delete fiber;
+            }
+            fibers.clear();
+            freeFibers = nullptr;
+        } else {
+            runWorkerLoop();
+        }
+#else
+        runWorkerLoop();
+#endif
+
+        endIdle();
+        finish();
+        // other workers may still be running jobs stolen from this one, which hand their slots back to its pools, so
+        // the thread (and its pools) must stay until every worker is done
+        --stoppingWorkers;
+        while (stoppingWorkers.load()) {
+            std::this_thread::yield();
+        }
+        threadIndex = -1;
+        LOG_DEBUG("%s stopped\n", threadName);
     }
 
-    void finish() {
-        threadScope->dispatch();
+    // blocking threads only run jobs from the blocking queues, most urgent first, one at a time. they have no
+    // queues of their own, so jobs they enqueue must go through Job::enqueueOnWorker or Job::enqueueOnMain
+    void runBlocking(int blockingIndex) {
+        sprintf(threadName, "io%d", blockingIndex);
+        SET_THREAD_NAME(threadName);
+        LOG_DEBUG("%s starting\n", threadName);
+        threadIndex = workerCount + 1 + blockingIndex;
+        isJobSystemThread = true; // so their continuations are never blocked or rejected by the backpressure policy
+
+        for (;;) {
+            if (runBlockingJob()) {
+                continue;
+            }
+            beginIdle(TraceEventType::Idle, nullptr);
+            uint32_t key = blockingEvent.prepareWait();
+            if (hasBlockingJobs() || blockingShouldStop) {
+                blockingEvent.cancelWait();
+                if (!hasBlockingJobs()) {
+                    break;
+                }
+                continue;
+            }
+            idleDetail = 1;
+            blockingEvent.wait(key);
+        }
+
+        endIdle();
+        threadScope->threadContext = nullptr; // nothing to dispatch
         delete threadScope;
         threadScope = nullptr;
         activeScope = nullptr;
-        queue = nullptr;
-#if PRINT_STATS
-        printf("%s   S:%d Y:%d P:%d   s:%d mt:%d wt:%d bg:%d\n", threadName, sleepCount, yieldCount, pauseCount, runOwnCount, stealMainCount, stealWorkerCount, bgCount);
-#endif
-    }
-
-    void enqueueJob(Job &job) {
-        assert(queue);
-        job.scope = activeScope;
-        ++activeScope->pendingCount;
-        queue->push(job);
-    }
-
-    void dispatchActiveScope() {
-        activeScope->dispatch();
+        threadIndex = -1;
+        LOG_DEBUG("%s stopped\n", threadName);
     }
 
-    bool dispatchSingleJob() {
-        // service own queue till empty
-        auto job = queue->pop();
-        if (job.has_value()) {
-            LOG_DEBUG("%s running own job\n", threadName);
-            INC_STAT(runOwnCount);
-            job->run();
-            return true;
+    static bool hasBlockingJobs() {
+        for (int i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+            if (!blockingQueues[i].empty()) {
+                return true;
+            }
         }
+        return false;
+    }
 
-        // steal from main queue
-        if (queue != &mainQueue) {
-            job = mainQueue.steal();
-            if (job.has_value()) {
-                LOG_DEBUG("%s stealing from main\n", threadName);
-                INC_STAT(stealMainCount);
-                job->run();
+    bool runBlockingJob() {
+        for (int i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+            Job job;
+            if (blockingQueues[i].popBatch(&job, 1)) {
+                releaseBlockedProducers(blockingQueues[i]);
+                runExternalJob(job, (JobPriority)i, TRACE_SOURCE_BLOCKING);
                 return true;
             }
         }
+        return false;
+    }
 
-        // steal from other worker queues (not self)
-        int count = workerCount + 1; // add one so we can dedicate an index to dispatching from the external queue
-        int start = rand() % count;
-        for (int i = 0; i < count; ++i) {
-            int idx = (start + i) % count;
-            if (idx < workerCount) {
-                JobQueue *workerQueue = &workerQueues[idx];
-                if (workerQueue != queue) {
-                    job = workerQueue->steal();
-                    if (job.has_value()) {
-                        LOG_DEBUG("%s stealing from worker%d\n", threadName, idx);
-                        INC_STAT(stealWorkerCount);
-                        job->run();
-                        return true;
-                    }
-                }
-            } else {
-                Job externalJob;
-                if (externalQueue->try_pop(externalJob)) {
-                    externalJob.run();
-                    return true;
-                }
+    static bool hasExternalWorkerJobs() {
+        for (int i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+            if (!externalWorkerQueues[i].empty()) {
+                return true;
             }
         }
-
         return false;
     }
 
-    void runWorker(int workerIndex) {
-        sprintf(threadName, "worker%d", workerIndex);
-        SET_THREAD_NAME(threadName);
-        LOG_DEBUG("%s starting\n", threadName);
+    // the scheduling loop of a worker. in fiber mode it runs on a fiber, and also continues fibers whose wait is over.
+    // when stopping, every worker (dormant ones too, since they don't steal) keeps going until the external queues
+    // are empty as well, so a continuation handed over just before the join still runs
+    void runWorkerLoop() {
+        int joblessIterations = 0;
 
-        queue = &workerQueues[workerIndex];
-        externalQueue = &externalWorkerQueue;
-        uint64_t joblessIterations = 0;
+        while (!workersShouldStop || parkedFibers || hasExternalWorkerJobs()) {
+            if (!workersShouldStop && isDormant()) {
+                runDormant();
+                joblessIterations = 0;
+                continue;
+            }
 
-        while (!workersShouldStop) {
-            while (dispatchSingleJob()) {
+            while (resumeReadyFiber() || dispatchSingleJob()) {
                 joblessIterations = 0; // we did some work!
+                countElasticJob();
             }
 
             // we couldn't find any more jobs to run (after looking once at each queue)
 
-            // make this loop progressively lighter on the CPU by yielding more CPU time as more and more iteratons pass without work done
-            if (++joblessIterations < 1000) {
+            beginIdle(TraceEventType::Idle, nullptr);
+            beginElasticIdle();
+
+            // spin for a short while, since work tends to come in bursts during a frame
+            if (++joblessIterations < SPINS_BEFORE_PARKING) {
                 INC_STAT(pauseCount);
                 PAUSE();
-            } else if (joblessIterations < 10000) {
-                INC_STAT(yieldCount);
-                std::this_thread::yield();
-            } else {
-                INC_STAT(sleepCount);
-                std::this_thread::sleep_for(std::chrono::milliseconds(4)); // don't sleep longer. keeps things responsive, while mostly eliminating CPU use
+                continue;
+            }
+
+            // then park until a job is enqueued
+            uint32_t key = workerEvent.prepareWait();
+            if (workersShouldStop || hasReadyFibers() || isDormant() || dispatchSingleJob()) {
+                workerEvent.cancelWait();
+                joblessIterations = 0;
+                continue;
+            }
+            INC_STAT(parkCount);
+            idleDetail = 1;
+            workerEvent.wait(key);
+            joblessIterations = 0;
+        }
+    }
+
+    JobFiber *getFreeFiber() {
+        JobFiber *fiber = freeFibers;
+        if (fiber) {
+            freeFibers = fiber->next;
+        } else {
+            fiber = new JobFiber(this, threadScope, fiberMain);
+            fibers.push_back(fiber);
+        }
+        return fiber;
+    }
+
+    void switchToFiber(JobFiber *next) {
+#if JOB_FIBERS_SUPPORTED
+        JobFiber *prev = currentFiber;
+        prev->activeScope = activeScope;
+        prev->runningToken = runningToken;
+        prev->runningBaseScope = runningBaseScope;
+        prev->runningPriority = runningPriority;
+        currentFiber = next;
+        activeScope = next->activeScope;
+        runningToken = next->runningToken;
+        runningBaseScope = next->runningBaseScope;
+        runningPriority = next->runningPriority;
+        jobFiberSwitch(&prev->stackPointer, next->stackPointer);
+#else
+        (void)next;
+#endif
+    }
+
+    // entry point of new fibers. runs the scheduling loop until the workers are stopped, then returns to the thread's own stack
+    void runFiber() {
+        runWorkerLoop();
+#if JOB_FIBERS_SUPPORTED
+        JobFiber *fiber = currentFiber;
+        currentFiber = nullptr;
+        activeScope = threadScope;
+        jobFiberSwitch(&fiber->stackPointer, rootStackPointer);
+#endif
+        abort(); // never resumed
+    }
+
+    // parks the current fiber until the scope's jobs are done, running other jobs on a fresh fiber in the meantime
+    void waitOnFiber(JobScope *scope) {
+        while (scope->pendingCount) {
+            scope->waitingFiber = currentFiber;
+            if (scope->pendingCount.fetch_add(JobScope::PENDING_FIBER_WAITING) == 0) {
+                scope->pendingCount -= JobScope::PENDING_FIBER_WAITING; // done after all, no one will wake us
+                break;
             }
+            ++parkedFibers;
+            switchToFiber(getFreeFiber());
+            --parkedFibers;
         }
+    }
 
-        finish();
-        LOG_DEBUG("%s stopped\n", threadName);
+    // called on any thread, by the one that completed the scope the fiber was waiting on
+    void makeFiberReady(JobFiber *fiber) {
+        JobFiber *head = readyFibers.load(std::memory_order_relaxed);
+        do {
+            fiber->next = head;
+        } while (!readyFibers.compare_exchange_weak(head, fiber, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool hasReadyFibers() {
+        return localReadyFibers || readyFibers.load(std::memory_order_relaxed);
+    }
+
+    // called between jobs by the scheduling loop: continues a fiber whose wait is over, and returns this one to the pool
+    bool resumeReadyFiber() {
+        if (!localReadyFibers) {
+            if (!readyFibers.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            localReadyFibers = readyFibers.exchange(nullptr, std::memory_order_acquire);
+        }
+        JobFiber *fiber = localReadyFibers;
+        localReadyFibers = fiber->next;
+        endIdle();
+        endElasticIdle();
+        currentFiber->next = freeFibers;
+        freeFibers = currentFiber;
+        switchToFiber(fiber);
+        return true;
     }
 };
 
 static thread_local ThreadContext currentThreadContext;
 
+static void fiberMain() {
+    currentThreadContext.runFiber();
+}
+
+
+// applies the backpressure policy when an external queue is at its limit. returns false if the job should be dropped
+static bool admitExternalJob(ExternalJobQueue &queue) {
+    if (queue.size() < externalQueueLimit) {
+        return true;
+    }
+    // threads of the job system never block or drop jobs, since they may be the ones that would drain the queue,
+    // or hand over work that can't be lost (like the continuation of a coroutine)
+    if (externalQueuePolicy == JobBackpressure::Grow || isJobSystemThread || isBackpressureExempt) {
+        ++externalOverLimitPushes;
+        return true;
+    }
+    if (externalQueuePolicy == JobBackpressure::Reject) {
+        ++externalRejectedPushes;
+        return false;
+    }
+    ++externalBlockedPushes;
+    ++blockedProducers;
+    for (;;) {
+        size_t depth = queue.getDepth().load();
+        if (depth < externalQueueLimit) {
+            break;
+        }
+        queue.getDepth().wait(depth);
+    }
+    --blockedProducers;
+    return true;
+}
+
 
 JobScope::JobScope() :
     threadContext(&currentThreadContext),
     prevActiveScope(threadContext->activeScope),
     parentScope(threadContext->activeScope),
-    pendingCount(0)
+    pendingCount(0),
+    priority(threadContext->getPriorityIn(parentScope)),
+    token(parentScope->token ? parentScope->token : threadContext->runningToken)
+{
+    assert(threadContext->queues);
+    threadContext->activeScope = this;
+    ++parentScope->pendingCount;
+}
+
+JobScope::JobScope(JobPriority priority) :
+    threadContext(&currentThreadContext),
+    prevActiveScope(threadContext->activeScope),
+    parentScope(threadContext->activeScope),
+    pendingCount(0),
+    priority(priority),
+    token(parentScope->token ? parentScope->token : threadContext->runningToken)
 {
-    assert(threadContext->queue);
+    assert(threadContext->queues);
     threadContext->activeScope = this;
     ++parentScope->pendingCount;
 }
@@ -178,18 +1469,35 @@ JobScope::JobScope(JobScope &parentScope) :
     threadContext(&currentThreadContext),
     prevActiveScope(threadContext->activeScope),
     parentScope(&parentScope),
-    pendingCount(0)
+    pendingCount(0),
+    priority(parentScope.priority),
+    token(parentScope.token ? parentScope.token : threadContext->runningToken)
 {
-    assert(threadContext->queue);
+    assert(threadContext->queues);
     threadContext->activeScope = this;
     ++parentScope.pendingCount;
 }
 
+JobScope::JobScope(CancellationToken &token) :
+    threadContext(&currentThreadContext),
+    prevActiveScope(threadContext->activeScope),
+    parentScope(threadContext->activeScope),
+    pendingCount(0),
+    priority(threadContext->getPriorityIn(parentScope)),
+    token(&token)
+{
+    assert(threadContext->queues);
+    threadContext->activeScope = this;
+    ++parentScope->pendingCount;
+}
+
 JobScope::JobScope(ThreadContext *threadContext) :
     threadContext(threadContext),
     prevActiveScope(nullptr),
     parentScope(nullptr),
-    pendingCount(0)
+    pendingCount(0),
+    priority(JobPriority::Normal),
+    token(nullptr)
 {
     if (threadContext) {
         threadContext->activeScope = this;
@@ -201,123 +1509,507 @@ JobScope::~JobScope() {
         dispatch();
         threadContext->activeScope = prevActiveScope;
         if (parentScope) {
-            --parentScope->pendingCount;
+            parentScope->decrementPending();
         }
     }
 }
 
-void JobScope::enqueueJob(Job &job) {
-    threadContext->enqueueJob(job);
+void JobScope::enqueueJob(Job *job, JobPriority priority) {
+    threadContext->enqueueJob(job, priority);
 }
 
 JobScope *JobScope::getActiveScope() {
     return currentThreadContext.activeScope;
 }
 
+// runs jobs from the main thread's external queue. with a budget, stops when the frame's budget is used up, or when
+// the next job's cost hint doesn't fit in what is left. the rest is carried over to the next frame. the first job
+// of a frame always runs, so a job hinted as more expensive than the whole budget can't get stuck
+static void drainMainJobs() {
+    if (!mainJobBudget) {
+        Job batch[EXTERNAL_BATCH_SIZE];
+        while (int count = externalMainQueue.popBatch(batch, EXTERNAL_BATCH_SIZE)) {
+            releaseBlockedProducers(externalMainQueue);
+            for (int i = 0; i < count; ++i) {
+                currentThreadContext.runExternalJob(batch[i], JobPriority::Normal);
+            }
+        }
+        return;
+    }
+    if (externalMainQueue.empty()) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    uint64_t frameTime = mainJobFrameTime;
+    while (frameTime < mainJobBudget) {
+        uint32_t maxCost = mainJobFrameCount ? uint32_t(std::min<uint64_t>((mainJobBudget - frameTime) / 1000, UINT32_MAX)) : UINT32_MAX;
+        Job job;
+        if (!externalMainQueue.popIfCheaper(job, maxCost)) {
+            break;
+        }
+        releaseBlockedProducers(externalMainQueue);
+        currentThreadContext.runExternalJob(job, JobPriority::Normal);
+        ++mainJobFrameCount;
+        frameTime = mainJobFrameTime + std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+    mainJobFrameTime = frameTime;
+}
+
+void JobScope::wakeWaitingFiber() {
+    JobFiber *fiber = waitingFiber;
+    pendingCount -= PENDING_FIBER_WAITING; // the waiting fiber can't leave dispatch() before it's resumed below
+    ThreadContext *owner = fiber->owner;
+    owner->makeFiberReady(fiber);
+    if (owner != &currentThreadContext) {
+        workerEvent.notifyAll(); // the owner may be parked, and there is no way to wake a particular worker
+        dormantEvent.notifyAll();
+    }
+}
+
 void JobScope::dispatch() {
-    assert(threadContext->queue);
+    assert(threadContext->queues);
+    if (threadContext->currentFiber) {
+        threadContext->waitOnFiber(this);
+    }
     while (pendingCount) {
-        if (!threadContext->dispatchSingleJob()) {
+        if (!threadContext->dispatchSingleJob(priority)) {
+            threadContext->beginIdle(TraceEventType::Wait, this);
             PAUSE();
         }
     }
-    if (threadContext->externalQueue == &externalMainQueue) {
-        for (;;) {
-            Job job;
-            if (!externalMainQueue.try_pop(job)) {
+    threadContext->endIdle();
+    if (threadContext->queues == mainQueues) {
+        drainMainJobs();
+    }
+}
+
+Job *Job::allocate() {
+    return currentThreadContext.jobPool.allocate();
+}
+
+void *Job::allocatePayload(size_t size, bool external) {
+    if (external) {
+        return PayloadPool::allocateFromHeap(size);
+    }
+    return currentThreadContext.payloadPool.allocate(size);
+}
+
+void Job::releasePayload(void *payload) {
+    currentThreadContext.payloadPool.release(payload);
+}
+
+void Job::enqueueJob(Job *job) {
+    currentThreadContext.enqueueJob(job, currentThreadContext.getPriorityIn(currentThreadContext.activeScope));
+}
+
+void Job::enqueueJob(Job *job, JobPriority priority) {
+    currentThreadContext.enqueueJob(job, priority);
+}
+
+JobScope *Job::beginBatch(int count) {
+    JobScope *scope = currentThreadContext.activeScope;
+    scope->pendingCount += count;
+    return scope;
+}
+
+void Job::enqueueBatchedJob(Job *job, JobScope *scope) {
+    job->scope = scope;
+    currentThreadContext.pushJob(job, currentThreadContext.getPriorityIn(scope));
+}
+
+void Job::enqueueJobInScope(Job *job, JobScope *scope) {
+    job->scope = scope;
+    ++scope->pendingCount;
+    currentThreadContext.pushJob(job, scope->priority);
+}
+
+bool Job::admitJobOnMain() {
+    return admitExternalJob(externalMainQueue);
+}
+
+bool Job::admitJobOnWorker(JobPriority priority) {
+    return admitExternalJob(externalWorkerQueues[(int)priority]);
+}
+
+void Job::enqueueJobOnMain(Job &job, uint32_t costHint) {
+    externalMainQueue.push(job, costHint);
+}
+
+void Job::enqueueJobOnWorker(Job &job, JobPriority priority) {
+    externalWorkerQueues[(int)priority].push(job);
+    workerEvent.notifyOne();
+}
+
+bool Job::admitBlockingJob(JobPriority priority) {
+    return admitExternalJob(blockingQueues[(int)priority]);
+}
+
+void Job::enqueueBlockingJob(Job &job, JobPriority priority) {
+    blockingQueues[(int)priority].push(job);
+    blockingEvent.notifyOne();
+}
+
+CancellationToken *Job::exchangeRunningToken(CancellationToken *token) {
+    return std::exchange(currentThreadContext.runningToken, token);
+}
+
+JobAllocationStats JobSystem::getAllocationStats() {
+    JobAllocationStats stats;
+    stats.jobChunkAllocations = jobChunkAllocations;
+    stats.payloadChunkAllocations = payloadChunkAllocations;
+    stats.payloadHeapAllocations = payloadHeapAllocations;
+    stats.fiberAllocations = fiberAllocations;
+    return stats;
+}
+
+JobStealStats JobSystem::getStealStats() {
+    JobStealStats stats;
+    for (auto &placement : threadPlacements) {
+        stats.smtSibling += placement.steals[(int)CpuDistance::SmtSibling];
+        stats.sameCache += placement.steals[(int)CpuDistance::SameCache];
+        stats.samePackage += placement.steals[(int)CpuDistance::SamePackage];
+        stats.remote += placement.steals[(int)CpuDistance::Remote];
+        stats.external += placement.steals[STEAL_STAT_EXTERNAL];
+        stats.contended += placement.steals[STEAL_STAT_CONTENDED];
+    }
+    return stats;
+}
+
+// called from the main thread while the job system is running. buffers of threads added by a later start() with
+// more workers are allocated there
+void JobSystem::setTracing(bool enabled) {
+    if (enabled == tracingEnabled) {
+        return;
+    }
+    if (enabled) {
+        allocateTraceBuffers();
+        waitForTraceWriters(); // for adds that were still finishing when tracing was last disabled
+        for (auto &buffer : traceBuffers) {
+            buffer->count = 0;
+        }
+        traceEpoch = std::chrono::steady_clock::now();
+    }
+    tracingEnabled.store(enabled);
+}
+
+bool JobSystem::isTracing() {
+    return tracingEnabled;
+}
+
+void JobSystem::traceInstant(const char *name) {
+    ThreadContext &context = currentThreadContext;
+    if (TraceBuffer *buffer = context.getTraceBuffer()) {
+        uint64_t now = traceNow();
+        buffer->add({ now, now, name, nullptr, TraceEventType::Instant, 0 });
+    }
+}
+
+bool JobSystem::writeTrace(const char *path) {
+    static const char *sourceNames[] = { "own", "main", "worker", "external", "blocking" };
+    assert(!tracingEnabled);
+    waitForTraceWriters();
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        return false;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (int tid = 0; tid < (int)traceBuffers.size(); ++tid) {
+        TraceBuffer *buffer = traceBuffers[tid].get();
+        if (!buffer) {
+            continue;
+        }
+        char threadName[32];
+        if (tid == workerCount) {
+            sprintf(threadName, "main");
+        } else if (tid > workerCount) {
+            sprintf(threadName, "io%d", tid - workerCount - 1);
+        } else {
+            sprintf(threadName, "worker%d", tid);
+        }
+        fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", tid, threadName);
+        first = false;
+        uint64_t count = buffer->count.load(std::memory_order_acquire);
+        uint64_t begin = count > TRACE_BUFFER_EVENTS ? count - TRACE_BUFFER_EVENTS : 0;
+        for (uint64_t i = begin; i < count; ++i) {
+            const TraceEvent &event = buffer->events[i & (TRACE_BUFFER_EVENTS - 1)];
+            double ts = event.begin / 1000.0;
+            double dur = (event.end - event.begin) / 1000.0;
+            switch (event.type) {
+            case TraceEventType::Job:
+                fprintf(fp, ",\n{\"ph\":\"X\",\"cat\":\"job\",\"name\":\"job (%s)\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"scope\":\"%p\",\"invoker\":\"%p\"}}",
+                    sourceNames[event.detail], tid, ts, dur, event.object, event.invoker);
+                break;
+            case TraceEventType::Idle:
+                fprintf(fp, ",\n{\"ph\":\"X\",\"cat\":\"idle\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    event.detail ? "parked" : "spinning", tid, ts, dur);
+                break;
+            case TraceEventType::Wait:
+                fprintf(fp, ",\n{\"ph\":\"X\",\"cat\":\"wait\",\"name\":\"wait\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"scope\":\"%p\"}}",
+                    tid, ts, dur, event.object);
+                break;
+            case TraceEventType::Instant:
+                fprintf(fp, ",\n{\"ph\":\"i\",\"s\":\"g\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                    (const char *)event.object, tid, ts);
                 break;
             }
-            job.run();
         }
     }
+    fprintf(fp, "\n]}\n");
+    return fclose(fp) == 0;
+}
+
+void JobSystem::setExternalQueueLimit(size_t limit, JobBackpressure policy) {
+    externalQueueLimit = limit;
+    externalQueuePolicy = policy;
+}
+
+ExternalQueueStats JobSystem::getExternalQueueStats() {
+    ExternalQueueStats stats;
+    stats.mainDepth = externalMainQueue.size();
+    stats.peakDepth = externalMainQueue.getPeakDepth();
+    for (int i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+        stats.workerDepth[i] = externalWorkerQueues[i].size();
+        stats.peakDepth = std::max(stats.peakDepth, externalWorkerQueues[i].getPeakDepth());
+        stats.blockingDepth[i] = blockingQueues[i].size();
+        stats.peakDepth = std::max(stats.peakDepth, blockingQueues[i].getPeakDepth());
+    }
+    stats.overLimitPushes = externalOverLimitPushes;
+    stats.blockedPushes = externalBlockedPushes;
+    stats.rejectedPushes = externalRejectedPushes;
+    return stats;
+}
+
+void JobSystem::exemptFromBackpressure() {
+    isBackpressureExempt = true;
+}
+
+void JobSystem::setMainJobBudget(float milliseconds) {
+    mainJobBudget = uint64_t(milliseconds * 1e6f);
+}
+
+float JobSystem::beginFrame() {
+    float overrun = 0;
+    ++mainJobStats.frames;
+    if (mainJobBudget && mainJobFrameTime > mainJobBudget) {
+        overrun = (mainJobFrameTime - mainJobBudget) / 1e6f;
+        ++mainJobStats.overrunFrames;
+        mainJobStats.maxOverrunMs = std::max(mainJobStats.maxOverrunMs, overrun);
+    }
+    size_t carried = externalMainQueue.size();
+    if (carried) {
+        ++mainJobStats.carryOverFrames;
+    }
+    mainJobStats.lastFrameMs = mainJobFrameTime / 1e6f;
+    mainJobStats.lastFrameJobs = mainJobFrameCount;
+    mainJobStats.lastCarriedOver = carried;
+    mainJobFrameTime = 0;
+    mainJobFrameCount = 0;
+    return overrun;
+}
+
+MainJobStats JobSystem::getMainJobStats() {
+    return mainJobStats;
 }
 
-void Job::enqueueJob(Job &job) {
-    currentThreadContext.enqueueJob(job);
+int JobSystem::getThreadCount() {
+    return workerCount + 1;
 }
 
-void Job::enqueueJobOnMain(Job &job) {
-    externalMainQueue.push(job);
+bool JobSystem::isWorkerThread() {
+    return currentThreadContext.queues && currentThreadContext.queues != mainQueues;
 }
 
-void Job::enqueueJobOnWorker(Job &job) {
-    externalWorkerQueue.push(job);
+bool JobSystem::isCancelled() {
+    if (!isJobSystemThread) {
+        return false;
+    }
+    ThreadContext &context = currentThreadContext;
+    return (context.runningToken && context.runningToken->isCancelled()) || (context.activeScope && context.activeScope->isCancelled());
+}
+
+bool JobSystem::isLocalQueueEmpty() {
+    ThreadContext &context = currentThreadContext;
+    // with duration learning, jobs predicted to be long (like the split-off halves of a parallelForRange) are queued
+    // separately, and they count as well
+    int priority = (int)context.getPriorityIn(context.activeScope);
+    return context.queues[priority].empty() && context.longQueues[priority].empty();
 }
 
 void JobSystem::dispatch() {
     currentThreadContext.dispatchActiveScope();
 }
 
-void JobSystem::start() {
+bool JobSystem::runPendingJob() {
+    if (!isJobSystemThread) {
+        return false;
+    }
+    ThreadContext &context = currentThreadContext;
+    if (!context.queues) {
+        return false; // blocking threads only run blocking jobs
+    }
+    if (context.queues == mainQueues) {
+        Job job;
+        if (externalMainQueue.popBatch(&job, 1)) {
+            releaseBlockedProducers(externalMainQueue);
+            context.runExternalJob(job, JobPriority::Normal);
+            return true;
+        }
+    }
+    return context.dispatchSingleJob(JobPriority::Normal);
+}
+
+// assigns threads to CPUs (one per physical core first, and filling one L3 before the next), and orders the steal
+// victims of each thread by distance. workers are only pinned when every thread (and reserved CPU) can have a CPU
+// of its own
+static void placeThreads() {
+    int threadCount = workerCount + 1;
+    std::vector<CpuInfo> cpus = readCpuTopology();
+    bool known = (int)cpus.size() >= threadCount + reservedCpuCount;
+    threadPlacements = std::vector<ThreadPlacement>(threadCount);
+    // main thread gets the first CPU, since it's the one the frame waits on. the reserved ones come next
+    auto cpuOf = [&] (int threadIndex) -> const CpuInfo & {
+        return cpus[threadIndex == workerCount ? 0 : 1 + reservedCpuCount + threadIndex];
+    };
+    reservedCpus.clear();
+    if (known) {
+        for (int i = 0; i < reservedCpuCount; ++i) {
+            reservedCpus.push_back(cpus[1 + i].cpu);
+        }
+    }
+    for (int t = 0; t < threadCount; ++t) {
+        ThreadPlacement &placement = threadPlacements[t];
+        std::vector<int> tiers[4];
+        for (int v = 0; v < workerCount; ++v) {
+            if (v != t) {
+                tiers[known ? (int)getCpuDistance(cpuOf(t), cpuOf(v)) : (int)CpuDistance::Remote].push_back(v);
+            }
+        }
+        for (int tier = 0; tier < 4; ++tier) {
+            placement.victims.insert(placement.victims.end(), tiers[tier].begin(), tiers[tier].end());
+            placement.tierEnds[tier] = placement.victims.size();
+        }
+        if (known) {
+            if (t < workerCount) {
+                placement.cpu = cpuOf(t).cpu; // the main thread is left unpinned, but keeps a CPU to itself
+            }
+            placement.mainDistance = (int)getCpuDistance(cpuOf(t), cpuOf(workerCount));
+        }
+    }
+}
+
+void JobSystem::setElasticWorkers(int minWorkers, int maxWorkers) {
+    std::lock_guard<std::mutex> lock(elasticMutex);
+    elasticMin = minWorkers;
+    elasticMax = maxWorkers;
+    if (workerThreads.size()) {
+        applyElasticWorkers();
+    }
+}
+
+int JobSystem::getActiveWorkerCount() {
+    return activeWorkerCount;
+}
+
+void JobSystem::reserveCpus(int count) {
+    reservedCpuCount = std::max(0, count);
+}
+
+bool JobSystem::pinToReservedCpu(int index) {
+    if (index < 0 || index >= (int)reservedCpus.size()) {
+        return false;
+    }
+    return pinCurrentThreadToCpu(reservedCpus[index]);
+}
+
+void JobSystem::setDurationLearning(bool enabled, float longJobMicroseconds) {
+    longJobNanos = uint32_t(longJobMicroseconds * 1000);
+    durationLearning = enabled;
+}
+
+void JobSystem::setBlockingThreadCount(int count) {
+    blockingThreadCount = std::max(0, count);
+}
+
+bool JobSystem::setFiberMode(bool enabled) {
+    fiberMode = enabled && JOB_FIBERS_SUPPORTED;
+    return fiberMode == enabled;
+}
+
+void JobSystem::start(int numWorkers) {
     sprintf(currentThreadContext.threadName, "main");
     SET_THREAD_NAME(currentThreadContext.threadName);
-    currentThreadContext.queue = &mainQueue;
-    currentThreadContext.externalQueue = &externalMainQueue;
-    workerCount = std::thread::hardware_concurrency();
-    if (workerCount > 2) {
-        --workerCount; // subtract one, since we also will have the main thread
+    currentThreadContext.queues = mainQueues;
+    currentThreadContext.longQueues = mainLongQueues;
+    isJobSystemThread = true;
+    if (!currentThreadContext.threadScope) {
+        currentThreadContext.threadScope = new JobScope(&currentThreadContext); // restarting after stop()
+    }
+    if (numWorkers > 0) {
+        workerCount = numWorkers;
+    } else {
+        workerCount = std::thread::hardware_concurrency();
+        if (workerCount > 2) {
+            --workerCount; // subtract one, since we also will have the main thread
+        }
+        workerCount = std::max(1, workerCount - reservedCpuCount);
+    }
+    workerQueues = new JobQueue[workerCount * JOB_PRIORITY_COUNT];
+    workerLongQueues = new JobQueue[workerCount * JOB_PRIORITY_COUNT];
+    if ((int)traceBuffers.size() < workerCount + 1 + blockingThreadCount) {
+        traceBuffers.resize(workerCount + 1 + blockingThreadCount);
     }
-    workerQueues = new JobQueue[workerCount];
+    if (tracingEnabled) {
+        allocateTraceBuffers();
+    }
+    placeThreads();
+    activeWorkerCount = elasticMin > 0 ? 0 : workerCount; // starts at the minimum
+    lastElasticEvaluation = nowNanos();
+    applyElasticWorkers();
+    currentThreadContext.setPlacement(workerCount);
     workerThreads.reserve(workerCount);
     for (int i = 0; i < workerCount; ++i) {
         workerThreads.emplace_back([i] { currentThreadContext.runWorker(i); });
     }
+    blockingThreads.reserve(blockingThreadCount);
+    for (int i = 0; i < blockingThreadCount; ++i) {
+        blockingThreads.emplace_back([i] { currentThreadContext.runBlocking(i); });
+    }
 }
 
 void JobSystem::stop() {
     currentThreadContext.finish();
+    isJobSystemThread = false;
+    // blocking threads go first, so jobs they hand to the workers still run. they leave once their queues are empty
+    blockingShouldStop = true;
+    blockingEvent.notifyAll();
+    for (auto &thread : blockingThreads) {
+        thread.join();
+    }
+    blockingShouldStop = false;
+    blockingThreads.clear();
+    stoppingWorkers = workerCount;
     workersShouldStop = true;
+    workerEvent.notifyAll();
+    dormantEvent.notifyAll();
     for (auto& thread : workerThreads) {
         thread.join();
     }
     workersShouldStop = false;
-    assert(mainQueue.empty());
+    for (int i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+        assert(mainQueues[i].empty());
+        assert(mainLongQueues[i].empty());
+        assert(externalWorkerQueues[i].empty());
+        assert(blockingQueues[i].empty());
+    }
     assert(externalMainQueue.empty());
-    assert(externalWorkerQueue.empty());
     workerThreads.clear();
     delete [] workerQueues;
     workerQueues = nullptr;
+    delete [] workerLongQueues;
+    workerLongQueues = nullptr;
 }
 
-
-#if 0
-#include <chrono>
-#include "Logger.h"
-
-static std::atomic<int> dtorCount;
-static std::atomic<int> ctorCount;
-static std::atomic<int> cctorCount;
-static std::atomic<int> mctorCount;
-static std::atomic<int> cassignCount;
-static std::atomic<int> massignCount;
-struct Counter {
-    __attribute__((noinline)) ~Counter() { ++dtorCount; }
-    __attribute__((noinline)) Counter() { ++ctorCount; }
-    __attribute__((noinline)) Counter(const Counter &) { ++cctorCount; }
-    __attribute__((noinline)) Counter(Counter &&) { ++mctorCount; }
-    __attribute__((noinline)) Counter& operator=(const Counter& other) { ++cassignCount; return *this; }
-    __attribute__((noinline)) Counter& operator=(Counter&& other) noexcept { ++massignCount; return *this; }
-};
-
-void testJobSystem() {
-    auto start = std::chrono::high_resolution_clock::now();
-    std::atomic<int> counter(0);
-    Counter counterObject;
-    {
-        JobScope scope;
-        for (int i = 0; i < 1000; ++i) {
-            Job::enqueue([&counter, &scope, counterObject = std::move(counterObject)] {
-                JobScope scope2(scope);
-                for (int j = 0; j < 1000; ++j) {
-                    Job::enqueue([&counter] {
-                        ++counter;
-                    });
-                }
-            });
-        }
-    }
-    auto end = std::chrono::high_resolution_clock::now();
-    logger->info("Test counter: %d in %d ms", (int)counter, (int)((end-start)/std::chrono::milliseconds(1)));
-    logger->info("dtorCount %d, ctorCount: %d, cctorCount: %d, mctorCount: %d, cassignCount: %d, massignCount: %d", (int)dtorCount, (int)ctorCount, (int)cctorCount, (int)mctorCount, (int)cassignCount, (int)massignCount);
-}
-#endif
@@ -2,8 +2,40 @@
 
 #include <atomic>
 #include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <coroutine>
+#include <type_traits>
+#include "RefCounted.h"
 
 class Job;
+class JobFiber;
+
+enum class JobPriority {
+    Critical,   // work the current frame is waiting on
+    Normal,
+    Background, // long-running work that no frame waits on, like asset decoding
+};
+
+enum { JOB_PRIORITY_COUNT = 3 };
+
+// what happens when a thread outside the job system enqueues a job on an external queue that is at its limit.
+// threads of the job system always get Grow, so they can't deadlock or lose continuations
+enum class JobBackpressure {
+    Grow,   // enqueue anyway (the queues are unbounded), and count it
+    Block,  // wait until the queue drains below the limit
+    Reject, // don't enqueue, and return false from Job::enqueueOnMain/enqueueOnWorker
+};
+
+// Cooperative cancellation of jobs and scopes sharing the token. Queued jobs are dropped without running when they
+// are dequeued after cancel(), and running ones can stop early by polling JobSystem::isCancelled().
+class CancellationToken : public RefCounted {
+    std::atomic<bool> cancelled = false;
+
+public:
+    void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+    bool isCancelled() const { return cancelled.load(std::memory_order_relaxed); }
+};
 
 class JobScope {
     friend Job;
@@ -14,12 +46,29 @@ class JobScope {
     JobScope *prevActiveScope;
     JobScope *parentScope;
     std::atomic<int> pendingCount;
+    JobFiber *waitingFiber; // parked in dispatch() until pendingCount reaches zero (in fiber mode)
+    JobPriority priority; // of jobs enqueued while this is the active scope. inherited from the parent scope by default,
+                          // or from the running job when it creates the scope
+    CancellationToken *token; // inherited from the parent scope, or else from the running job
 
-    void enqueueJob(Job &job);
+    void enqueueJob(Job *job, JobPriority priority);
+    void wakeWaitingFiber();
+
+    enum { PENDING_FIBER_WAITING = 1 << 30 }; // added to pendingCount while a fiber is parked on the scope
+
+    // the decrement that leaves only the waiting flag wakes the parked fiber. other decrements don't touch the scope
+    // afterwards, since the thread owning it may then leave dispatch() and destroy it
+    void decrementPending(int count = 1) {
+        if (pendingCount.fetch_sub(count) == PENDING_FIBER_WAITING + count) {
+            wakeWaitingFiber();
+        }
+    }
 
 public:
     JobScope();
+    explicit JobScope(JobPriority priority);
     JobScope(JobScope &parentScope);
+    explicit JobScope(CancellationToken &token); // the token must outlive the scope
     JobScope(class ThreadContext *threadContext);
     ~JobScope();
 
@@ -28,8 +77,20 @@ public:
 
     static JobScope *getActiveScope();
 
+    JobPriority getPriority() const {
+        return priority;
+    }
+
+    bool isCancelled() const {
+        return token && token->isCancelled();
+    }
+
     void addPendingCount(int diff) {
-        pendingCount += diff;
+        if (diff < 0) {
+            decrementPending(-diff);
+        } else {
+            pendingCount += diff;
+        }
     }
 
     template <typename Func>
@@ -42,67 +103,187 @@ class Job {
     friend JobScope;
     friend class JobSystem;
     friend class ThreadContext;
+    friend class JobPool;
 
-    using Invoker = void (*)(void *);
+    using Invoker = void (*)(void *, bool run); // destroys the job's function, after calling it if run is set
     enum { MAX_DATA = 64 - sizeof(Invoker) - sizeof(JobScope *) };
 
-    JobScope *scope;
+    union {
+        JobScope *scope;
+        Job *nextFree; // link in the owning JobPool's free lists while the job slot is not in use
+    };
     Invoker invoker;
     char data[MAX_DATA];
 
     template <typename Func>
     struct Helper {
-        static_assert(sizeof(Func) <= MAX_DATA);
-
         Func func;
 
         Helper(Func &&func) : func(std::forward<Func>(func)) {}
 
-        static void invoker(void *data) {
+        static void invoker(void *data, bool run) {
             Helper *self = static_cast<Helper *>(data);
-            self->func();
+            if (run) {
+                self->func();
+            }
             self->func.~Func(); // all enqueued jobs will be invoked precisely 1 time, so explicitly calling the destructor like this is suitable
         }
     };
 
+    // for captures too large to fit in the job itself. the helper is placed in a payload block, and only the pointer is stored inline
     template <typename Func>
-    void setFunc(Func &&func) {
+    struct OverflowHelper {
+        Helper<Func> *helper;
+
+        static void invoker(void *data, bool run) {
+            Helper<Func> *helper = static_cast<OverflowHelper *>(data)->helper;
+            Helper<Func>::invoker(helper, run);
+            releasePayload(helper);
+        }
+    };
+
+    // local jobs take overflow payloads from the enqueuing thread's slab. external jobs may be enqueued from any thread
+    // and can outlive it, so they fall back to the heap
+    template <typename Func>
+    void setFunc(Func &&func, bool external = false) {
         scope = nullptr; // will be set when enqueued
-        invoker = Helper<Func>::invoker;
-        new (data) Helper<Func>(std::forward<Func>(func));
+        if constexpr (sizeof(Helper<Func>) <= MAX_DATA) {
+            invoker = Helper<Func>::invoker;
+            new (data) Helper<Func>(std::forward<Func>(func));
+        } else {
+            static_assert(alignof(Helper<Func>) <= alignof(std::max_align_t));
+            auto helper = new (allocatePayload(sizeof(Helper<Func>), external)) Helper<Func>(std::forward<Func>(func));
+            invoker = OverflowHelper<Func>::invoker;
+            new (data) OverflowHelper<Func> { helper };
+        }
+    }
+
+    template <typename Func>
+    struct Cancellable {
+        Ref<CancellationToken> token;
+        Func func;
+
+        void operator()() {
+            if (!token->isCancelled()) {
+                CancellationToken *prevToken = exchangeRunningToken(token.get());
+                func();
+                exchangeRunningToken(prevToken);
+            }
+        }
+    };
+
+    // jobs of a cancelled scope are dropped here, when dequeued
+    void invoke() {
+        invoker((void *)data, !scope || !scope->isCancelled());
     }
 
     void run() {
-        invoker((void *)data);
+        invoke();
         if (scope) {
-            --scope->pendingCount;
+            scope->decrementPending();
         }
     }
 
-    static void enqueueJob(Job &job);
-    static void enqueueJobOnMain(Job &job);
-    static void enqueueJobOnWorker(Job &job);
+    static Job *allocate();
+    static void *allocatePayload(size_t size, bool external);
+    static void releasePayload(void *payload);
+    static void enqueueJob(Job *job);
+    static void enqueueJob(Job *job, JobPriority priority);
+    static JobScope *beginBatch(int count);
+    static void enqueueBatchedJob(Job *job, JobScope *scope);
+    static void enqueueJobInScope(Job *job, JobScope *scope);
+    static bool admitJobOnMain();
+    static bool admitJobOnWorker(JobPriority priority);
+    static void enqueueJobOnMain(Job &job, uint32_t costHint);
+    static void enqueueJobOnWorker(Job &job, JobPriority priority);
+    static bool admitBlockingJob(JobPriority priority);
+    static void enqueueBlockingJob(Job &job, JobPriority priority);
+    static CancellationToken *exchangeRunningToken(CancellationToken *token);
 
 public:
+    // wraps func in a job function that is dropped if the token has been cancelled by the time it runs, and that
+    // JobSystem::isCancelled() reports on while it runs. scopes created inside it inherit the token. usable with
+    // every enqueue function, like Job::enqueueOnWorker(Job::cancellable(token, [] { ... }))
+    template <typename Func>
+    static Cancellable<std::decay_t<Func>> cancellable(CancellationToken *token, Func &&func) {
+        return { token, std::forward<Func>(func) };
+    }
+
+    // enqueued at the priority of the active scope. a job that hasn't created a scope of its own enqueues at the
+    // priority it was queued at, so the children of a background job stay background
     template <typename Func>
     inline static void enqueue(Func &&func) {
-        Job job;
-        job.setFunc(std::forward<Func>(func));
+        Job *job = allocate();
+        job->setFunc(std::forward<Func>(func));
         enqueueJob(job);
     }
 
     template <typename Func>
-    inline static void enqueueOnMain(Func &&func) {
+    inline static void enqueue(Func &&func, JobPriority priority) {
+        Job *job = allocate();
+        job->setFunc(std::forward<Func>(func));
+        enqueueJob(job, priority);
+    }
+
+    // enqueued into the given scope instead of the active one, at its priority. the scope must be waited on (which
+    // happens when it is destroyed) before it goes away, which also covers jobs enqueued from other threads
+    template <typename Func>
+    inline static void enqueueIn(JobScope &scope, Func &&func) {
+        Job *job = allocate();
+        job->setFunc(std::forward<Func>(func));
+        enqueueJobInScope(job, &scope);
+    }
+
+    // enqueues count jobs, where job i calls func(i), with a single update of the active scope's pending count
+    template <typename Func>
+    inline static void enqueueBatch(int count, const Func &func) {
+        JobScope *scope = beginBatch(count);
+        for (int i = 0; i < count; ++i) {
+            Job *job = allocate();
+            job->setFunc([func, i] { func(i); });
+            enqueueBatchedJob(job, scope);
+        }
+    }
+
+    // enqueueOnMain and enqueueOnWorker may be called from any thread. they return false if the job was rejected
+    // by the backpressure policy (see JobSystem::setExternalQueueLimit)
+    // costHint is an estimate of the job's run time in microseconds (0 if unknown), used when the main thread
+    // drains its jobs within a frame budget (see JobSystem::setMainJobBudget)
+    template <typename Func>
+    inline static bool enqueueOnMain(Func &&func, uint32_t costHint = 0) {
+        if (!admitJobOnMain()) {
+            return false;
+        }
+        Job job;
+        job.setFunc(std::forward<Func>(func), true);
+        enqueueJobOnMain(job, costHint);
+        return true;
+    }
+
+    template <typename Func>
+    inline static bool enqueueOnWorker(Func &&func, JobPriority priority = JobPriority::Normal) {
+        if (!admitJobOnWorker(priority)) {
+            return false;
+        }
         Job job;
-        job.setFunc(std::forward<Func>(func));
-        enqueueJobOnMain(job);
+        job.setFunc(std::forward<Func>(func), true);
+        enqueueJobOnWorker(job, priority);
+        return true;
     }
 
+    // for jobs that block, like file IO. they run on a small pool of blocking threads (see
+    // JobSystem::setBlockingThreadCount), so they don't hold up a worker. may be called from any thread, like
+    // enqueueOnWorker. blocking jobs don't belong to a scope, so they hand their results on with enqueueOnWorker or
+    // enqueueOnMain (or by resuming a coroutine)
     template <typename Func>
-    inline static void enqueueOnWorker(Func &&func) {
+    inline static bool enqueueBlocking(Func &&func, JobPriority priority = JobPriority::Normal) {
+        if (!admitBlockingJob(priority)) {
+            return false;
+        }
         Job job;
-        job.setFunc(std::forward<Func>(func));
-        enqueueJobOnWorker(job);
+        job.setFunc(std::forward<Func>(func), true);
+        enqueueBlockingJob(job, priority);
+        return true;
     }
 };
 
@@ -110,16 +291,131 @@ static_assert(sizeof(Job) == 64);
 
 template <typename Func>
 inline void JobScope::enqueue(Func &&func) {
-    Job job;
-    job.setFunc(std::forward<Func>(func));
-    enqueueJob(job);
+    Job *job = Job::allocate();
+    job->setFunc(std::forward<Func>(func));
+    enqueueJob(job, priority);
 }
 
+// counts of every malloc the job system does on behalf of jobs. after warm-up these should stay constant from frame to frame
+struct JobAllocationStats {
+    uint64_t jobChunkAllocations = 0;     // chunks of job slots
+    uint64_t payloadChunkAllocations = 0; // slabs for captures that don't fit inline
+    uint64_t payloadHeapAllocations = 0;  // oversized captures of external jobs, or bigger than the largest slab size class
+    uint64_t fiberAllocations = 0;        // fibers with their stacks, in fiber mode
+};
+
+// where stolen jobs came from, relative to the stealing thread. without CPU topology info all steals count as remote
+struct JobStealStats {
+    uint64_t smtSibling = 0;
+    uint64_t sameCache = 0;   // other core sharing the last level cache
+    uint64_t samePackage = 0;
+    uint64_t remote = 0;      // other package
+    uint64_t external = 0;    // jobs enqueued from threads outside the job system
+    uint64_t contended = 0;   // steal attempts on a non-empty queue that lost the race for its top job
+};
+
+struct ExternalQueueStats {
+    size_t mainDepth = 0;
+    size_t workerDepth[JOB_PRIORITY_COUNT] = {};
+    size_t blockingDepth[JOB_PRIORITY_COUNT] = {};
+    size_t peakDepth = 0;         // deepest any external queue has been
+    uint64_t overLimitPushes = 0; // enqueued past the limit with JobBackpressure::Grow
+    uint64_t blockedPushes = 0;
+    uint64_t rejectedPushes = 0;
+};
+
+struct MainJobStats {
+    uint64_t frames = 0;
+    uint64_t overrunFrames = 0;   // frames that spent more than the budget on main thread jobs
+    uint64_t carryOverFrames = 0; // frames that left main thread jobs for the next one
+    float maxOverrunMs = 0;
+    float lastFrameMs = 0;        // spent on main thread jobs in the last complete frame
+    int lastFrameJobs = 0;
+    size_t lastCarriedOver = 0;
+};
+
 class JobSystem {
 public:
+    // continues the awaiting coroutine in a job on a worker thread
+    struct ScheduleAwaiter {
+        JobPriority priority;
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            return Job::enqueueOnWorker([handle] { handle.resume(); }, priority); // continue right here if rejected
+        }
+
+        void await_resume() const noexcept { }
+    };
+
+    static ScheduleAwaiter schedule(JobPriority priority = JobPriority::Normal) {
+        return ScheduleAwaiter { priority };
+    }
+
+    static JobAllocationStats getAllocationStats();
+    static JobStealStats getStealStats(); // totals since start()
+
+    // the external queues (including those of blocking jobs) are unbounded. the limit (per queue, none by default)
+    // only decides when the policy applies
+    static void setExternalQueueLimit(size_t limit, JobBackpressure policy);
+    static ExternalQueueStats getExternalQueueStats();
+    // exempts the calling thread from the policy, like the threads of the job system. for threads outside it that
+    // hand over work that can't wait or be lost, like an IO thread resuming coroutines
+    static void exemptFromBackpressure();
+
+    // Limits the time spent per frame on jobs enqueued with Job::enqueueOnMain (0, the default, drains them all in
+    // every JobScope::dispatch on the main thread). What doesn't fit carries over to the next frame.
+    // beginFrame() starts a new frame's budget, and returns how many milliseconds the previous frame went over it.
+    static void setMainJobBudget(float milliseconds);
+    static float beginFrame();
+    static MainJobStats getMainJobStats();
+
+    // Job tracing. While enabled, every thread records job runs (with the scope and where the job was taken from),
+    // idle periods and waits in JobScope::dispatch into its own ring buffer, keeping the most recent events.
+    static void setTracing(bool enabled);
+    static bool isTracing();
+    static void traceInstant(const char *name); // marker on the calling thread's timeline. name must be a string literal
+    static bool writeTrace(const char *path); // Chrome trace JSON, for chrome://tracing or ui.perfetto.dev. call with tracing disabled
+    static int getThreadCount(); // workers plus the main thread
+    static bool isWorkerThread();
+    static bool isCancelled(); // whether the running job's token, or that of the active scope, has been cancelled
+    static bool isLocalQueueEmpty(); // whether the calling thread's queues (long jobs included) for the priority Job::enqueue would use are empty
     static void dispatch();
-    static void start();
+
+    // For waits outside the job system that can be polled (like GPU fences): runs one job on the calling thread, and
+    // returns false if there was none to take. On the main thread, jobs enqueued with Job::enqueueOnMain go first,
+    // and they don't count against the main job budget, since the time would otherwise be lost to the wait. Background
+    // jobs are only taken from the own queues, so a long one from elsewhere can't hold up the thread past the wait.
+    static bool runPendingJob();
+    static void start(int numWorkers = 0); // zero picks a worker count from the number of hardware threads
+
+    // In fiber mode (set before start), workers run jobs on pooled fibers. A JobScope::dispatch on a worker that has
+    // to wait parks its fiber, and the worker goes on with other jobs on a fresh one. The parked fiber continues as
+    // soon as the scope's jobs are done, instead of when an unrelated job picked up while waiting returns, and nested
+    // waits no longer grow the stack. Only available on x86-64 outside Windows. The main thread never uses fibers.
+    static bool setFiberMode(bool enabled); // returns false if not available
+
+    // Learns how long jobs take, per call site (a moving average keyed by the job's invoker). Jobs predicted to take
+    // at least longJobMicroseconds are started before the others: the enqueuing thread and thieves take them first,
+    // so a long job doesn't get picked up last and hold up the completion of its scope. Off by default, since it
+    // reads the clock around every job. May be toggled at any time.
+    static void setDurationLearning(bool enabled, float longJobMicroseconds = 200);
+
+    // threads for Job::enqueueBlocking (set before start, 2 by default). they sleep while there are no blocking jobs
+    static void setBlockingThreadCount(int count);
+
+    // Elastic worker count. Only minWorkers of the started workers are active at first. More become active while
+    // there is a backlog of queued jobs that the active ones are too busy for, and they go dormant again while the
+    // active ones are idle much of the time. maxWorkers caps the active count (0 for all of them). May be called
+    // before or after start, and a minWorkers of 0 (the default) keeps all workers active.
+    static void setElasticWorkers(int minWorkers, int maxWorkers = 0);
+    static int getActiveWorkerCount();
+
+    // Keeps count CPUs free of workers, for threads outside the job system like a render thread (set before start).
+    // The automatic worker count is lowered by as much. pinToReservedCpu pins the calling thread to one of them,
+    // and returns false if the CPU topology is unknown
+    static void reserveCpus(int count);
+    static bool pinToReservedCpu(int index);
     static void stop();
 };
-
-void testJobSystem();
@@ -0,0 +1,158 @@
+#include "Lz.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_SHIFT 6 // after 64 bytes without a match, positions are skipped, so incompressible data goes faster
+
+
+static uint32_t load32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// the 4 bit field holds up to 14, 15 means bytes follow
+static bool writeLength(unsigned char *&op, unsigned char *end, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (op == end) {
+            return false;
+        }
+        *op++ = 255;
+    }
+    if (op == end) {
+        return false;
+    }
+    *op++ = (unsigned char)length;
+    return true;
+}
+
+static bool writeSequence(unsigned char *&op, unsigned char *end, const unsigned char *literals, size_t literalCount, size_t offset, size_t matchLength) {
+    if (op == end) {
+        return false;
+    }
+    unsigned char *token = op++;
+    *token = (unsigned char)(std::min<size_t>(literalCount, 15) << 4);
+    if (literalCount >= 15 && !writeLength(op, end, literalCount - 15)) {
+        return false;
+    }
+    if ((size_t)(end - op) < literalCount) {
+        return false;
+    }
+    if (literalCount) {
+        memcpy(op, literals, literalCount);
+        op += literalCount;
+    }
+    if (!matchLength) {
+        return true; // the last sequence
+    }
+    if (end - op < 2) {
+        return false;
+    }
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    size_t length = matchLength - LZ_MIN_MATCH;
+    *token |= (unsigned char)std::min<size_t>(length, 15);
+    return length < 15 || writeLength(op, end, length - 15);
+}
+
+size_t lzCompress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS] = {}; // positions + 1, so 0 is empty
+    unsigned char *op = dst;
+    unsigned char *end = dst + capacity;
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t value = load32(src + pos);
+        uint32_t &slot = table[hash32(value)];
+        size_t candidate = slot;
+        slot = (uint32_t)pos + 1;
+        if (!candidate || pos - (candidate - 1) > LZ_MAX_OFFSET || load32(src + candidate - 1) != value) {
+            pos += 1 + ((pos - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+        size_t match = candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+        while (pos + length < size && src[match + length] == src[pos + length]) {
+            ++length;
+        }
+        if (!writeSequence(op, end, src + anchor, pos - anchor, pos - match, length)) {
+            return 0;
+        }
+        pos += length;
+        anchor = pos;
+    }
+    if (!writeSequence(op, end, src + anchor, size - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - dst;
+}
+
+static bool readLength(const unsigned char *&ip, const unsigned char *end, size_t &length) {
+    unsigned char byte;
+    do {
+        if (ip == end) {
+            return false;
+        }
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool lzDecompress(const unsigned char *src, size_t size, unsigned char *dst, size_t dstSize) {
+    const unsigned char *ip = src;
+    const unsigned char *end = src + size;
+    unsigned char *op = dst;
+    unsigned char *dstEnd = dst + dstSize;
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 && !readLength(ip, end, literalCount)) {
+            return false;
+        }
+        if ((size_t)(end - ip) < literalCount || (size_t)(dstEnd - op) < literalCount) {
+            return false;
+        }
+        if (literalCount) {
+            memcpy(op, ip, literalCount);
+            ip += literalCount;
+            op += literalCount;
+        }
+        if (ip == end) {
+            break; // the last sequence
+        }
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !readLength(ip, end, length)) {
+            return false;
+        }
+        length += LZ_MIN_MATCH;
+        if (!offset || offset > (size_t)(op - dst) || (size_t)(dstEnd - op) < length) {
+            return false;
+        }
+        const unsigned char *match = op - offset;
+        if (offset >= length) {
+            memcpy(op, match, length);
+            op += length;
+        } else {
+            // overlapping, like a run of a repeated pattern
+            for (size_t i = 0; i < length; ++i) {
+                *op++ = match[i];
+            }
+        }
+    }
+    return op == dstEnd;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+// Byte-oriented LZ77 codec in the style of LZ4, for pack file blocks: fast to decompress, modest ratio. A block is a
+// series of sequences, each a token (literal count and match length in 4 bits each, extended by bytes of 255 when
+// they don't fit), the literals, and a 16-bit match offset. The last sequence has only literals.
+
+// worst case size of compressing size bytes
+inline size_t lzCompressBound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+// returns the compressed size, or 0 if it doesn't fit in capacity
+size_t lzCompress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity);
+
+// false if the data is corrupt, or doesn't decompress to exactly dstSize bytes
+bool lzDecompress(const unsigned char *src, size_t size, unsigned char *dst, size_t dstSize);
@@ -17,6 +17,7 @@
 #include "DeviceManager.h"
 #include "AssetLoader.h"
 #include "JobSystem.h"
+#include "FrameArena.h"
 #include "DebugLines.h"
 #include "SkyBox.h"
 #include "Camera.h"
@@ -85,7 +86,9 @@ struct DelegateImpl : public DeviceManagerDelegate {
 };
 
 int main(int argc, char* argv[]) {
+    JobSystem::setElasticWorkers(1); // the rest only wake up for loading bursts, so an idle window leaves the machine alone
     JobSystem::start();
+    JobSystem::setMainJobBudget(2.0f); // texture uploads finishing are submitted from main thread jobs
 
     VkResult vr = volkInitialize();
     if (vr != VK_SUCCESS) {
@@ -130,6 +133,7 @@ int main(int argc, char* argv[]) {
     nvrhi::CommandListHandle commandList = device->createCommandList();
 
     AssetLoader::initialize(device);
+    AssetLoader::mountPack("assets.pak"); // made by make pack. without it the loose files are loaded
     initDebugLines();
     initSkyBox();
     setSkyBoxTexture("space_cubemap.jpg");
@@ -161,7 +165,13 @@ int main(int argc, char* argv[]) {
         drawDebugLine(glm::vec3(0), glm::vec3(0, 10, 0), glm::vec4(0, 1, 0, 1));
         drawDebugLine(glm::vec3(0), glm::vec3(0, 0, 10), glm::vec4(0, 0, 1, 1));
 
-        JobScope jobScope;
+        JobSystem::traceInstant("frame");
+        FrameArena::beginFrame();
+        float mainJobOverrun = JobSystem::beginFrame();
+        if (mainJobOverrun > 0) {
+            logger->warning("Main thread jobs went %.2f ms over budget", mainJobOverrun);
+        }
+        JobScope jobScope(JobPriority::Critical);
         SDL_Event event;
         while (SDL_PollEvent(&event) && !deviceManager->isRecreateSwapchainRequested()) {
             if (camera.handleSDLEvent(&event)) {
@@ -181,6 +191,23 @@ int main(int argc, char* argv[]) {
                 case SDLK_ESCAPE:
                     running = false;
                     break;
+                case SDLK_t:
+                    // toggle job tracing, and write out what was recorded when turning it off
+                    if (JobSystem::isTracing()) {
+                        JobSystem::setTracing(false);
+                        if (JobSystem::writeTrace("jobtrace.json")) {
+                            logger->info("Wrote jobtrace.json");
+                        }
+                    } else {
+                        JobSystem::setTracing(true);
+                    }
+                    break;
+                case SDLK_m:
+                    for (auto &stats : FrameArena::getStats()) {
+                        logger->info("Frame arena %s: high watermark %zu, reserved %zu, block allocations %llu", stats.threadName,
+                            stats.highWatermark, stats.reserved, (unsigned long long)stats.blockAllocations);
+                    }
+                    break;
                 }
                 break;
             }
@@ -0,0 +1,123 @@
+#include "PackFile.h"
+#include "Lz.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define PACK_READ_CHUNK (1024 * 1024) // compressed bytes per read of a compressed entry
+
+
+bool PackFile::open(const std::string &packPath) {
+    FILE *fp = fopen(packPath.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    PackHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1
+        && header.magic == PACK_MAGIC
+        && header.version == PACK_VERSION
+        && fseek(fp, (long)header.indexOffset, SEEK_SET) == 0;
+    if (ok) {
+        entries.resize(header.entryCount);
+        names.resize(header.namesSize);
+        ok = fread(entries.data(), sizeof(PackEntry), entries.size(), fp) == entries.size()
+            && fread(names.data(), 1, names.size(), fp) == names.size();
+    }
+    fclose(fp);
+    for (const PackEntry &entry : entries) {
+        ok = ok && (uint64_t)entry.nameOffset + entry.nameLength <= names.size() && entry.offset + entry.storedSize <= header.indexOffset;
+    }
+    if (!ok) {
+        entries.clear();
+        names.clear();
+        return false;
+    }
+    path = packPath;
+    return true;
+}
+
+const PackEntry *PackFile::find(const std::string &entryPath) const {
+    uint64_t hash = hashPackPath(entryPath.data(), entryPath.size());
+    auto it = std::lower_bound(entries.begin(), entries.end(), hash, [] (const PackEntry &entry, uint64_t hash) {
+        return entry.pathHash < hash;
+    });
+    for (; it != entries.end() && it->pathHash == hash; ++it) {
+        if (it->nameLength == entryPath.size() && !memcmp(&names[it->nameOffset], entryPath.data(), entryPath.size())) {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+Task<bool> PackFile::readBlocks(const PackEntry *entry, const uint64_t *blockOffsets, uint32_t first, uint32_t last, unsigned char *output) const {
+    uint64_t chunkOffset = blockOffsets[first];
+    FileData chunk = co_await FileIO::readFile(path, chunkOffset, blockOffsets[last] - chunkOffset);
+    if (!chunk.ok) {
+        co_return false;
+    }
+    std::atomic<bool> ok = true;
+    {
+        JobScope scope;
+        Job::enqueueBatch(last - first, [&] (int i) {
+            uint32_t block = first + i;
+            const unsigned char *src = chunk.data + (blockOffsets[block] - chunkOffset);
+            size_t storedSize = blockOffsets[block + 1] - blockOffsets[block];
+            uint64_t begin = (uint64_t)block * entry->blockSize;
+            size_t size = std::min<uint64_t>(entry->blockSize, entry->size - begin);
+            if (storedSize == size) {
+                memcpy(output + begin, src, size); // didn't compress
+            } else if (!lzDecompress(src, storedSize, output + begin, size)) {
+                ok = false;
+            }
+        });
+    }
+    FileIO::releaseData(chunk.data, chunk.size, chunk.mapped);
+    co_return ok;
+}
+
+Task<FileData> PackFile::read(const PackEntry *entry) const {
+    if (!entry->blockSize) {
+        co_return co_await FileIO::readFile(path, entry->offset, entry->size);
+    }
+    uint32_t blockCount = (uint32_t)((entry->size + entry->blockSize - 1) / entry->blockSize);
+    uint64_t tableSize = blockCount * sizeof(uint32_t);
+    FileData table = co_await FileIO::readFile(path, entry->offset, tableSize);
+    if (!table.ok) {
+        co_return table;
+    }
+    std::vector<uint64_t> blockOffsets(blockCount + 1); // in the pack file
+    blockOffsets[0] = entry->offset + tableSize;
+    for (uint32_t i = 0; i < blockCount; ++i) {
+        uint32_t storedSize;
+        memcpy(&storedSize, table.data + i * sizeof(uint32_t), sizeof(storedSize));
+        blockOffsets[i + 1] = blockOffsets[i] + storedSize;
+    }
+    FileIO::releaseData(table.data, table.size, table.mapped);
+    FileData file;
+    if (blockOffsets[blockCount] != entry->offset + entry->storedSize) {
+        co_return file; // corrupt
+    }
+
+    file.data = (unsigned char *)malloc(entry->size);
+    file.size = entry->size;
+    std::vector<Task<bool>> chunks;
+    for (uint32_t first = 0, last; first < blockCount; first = last) {
+        for (last = first + 1; last < blockCount && blockOffsets[last + 1] - blockOffsets[first] <= PACK_READ_CHUNK; ++last) {
+        }
+        chunks.push_back(readBlocks(entry, blockOffsets.data(), first, last, file.data));
+    }
+    co_await whenAll(chunks);
+    file.ok = true;
+    for (auto &chunk : chunks) {
+        file.ok = file.ok && chunk.result();
+    }
+    if (!file.ok) {
+        free(file.data);
+        file.data = nullptr;
+        file.size = 0;
+    }
+    co_return file;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "FileIO.h"
+#include "Task.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Pack file layout: a header, the payloads (each starting on a PACK_ALIGNMENT boundary, so they can be mapped), then
+// the index at indexOffset. The index is an array of entries sorted by path hash, followed by the paths they were
+// packed under (like "assets/shaders/simple.vert.spv"), which are compared on lookup in case hashes collide.
+//
+// Compressed payloads are split into blocks of blockSize bytes (the last one shorter), compressed independently
+// with lzCompress. The payload starts with a table of the compressed size of each block as uint32_t, followed by the
+// blocks. A block that didn't compress is stored as is, which shows as a compressed size equal to its size.
+#define PACK_MAGIC 0x4b415056 // "VPAK"
+#define PACK_VERSION 2
+#define PACK_ALIGNMENT 4096
+#define PACK_BLOCK_SIZE (128 * 1024)
+
+struct PackHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entryCount;
+    uint32_t namesSize;
+    uint64_t indexOffset;
+};
+
+struct PackEntry {
+    uint64_t pathHash;
+    uint64_t offset;
+    uint64_t size; // of the file
+    uint64_t storedSize; // of the payload, which is smaller if compressed
+    uint32_t nameOffset; // in the names following the entries
+    uint32_t nameLength;
+    uint32_t blockSize; // 0 if stored uncompressed
+    uint32_t reserved;
+};
+
+static_assert(sizeof(PackHeader) == 24 && sizeof(PackEntry) == 48);
+
+// FNV-1a
+inline uint64_t hashPackPath(const char *path, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char)path[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// The index of a pack, which is read whole when opened. Payloads are then read with FileIO.
+class PackFile {
+    Task<bool> readBlocks(const PackEntry *entry, const uint64_t *blockOffsets, uint32_t first, uint32_t last, unsigned char *output) const;
+
+    std::string path;
+    std::vector<PackEntry> entries;
+    std::vector<char> names;
+
+public:
+    bool open(const std::string &path); // false if missing or not a pack of this version
+    const std::string &getPath() const { return path; }
+    const PackEntry *find(const std::string &path) const;
+
+    // Reads an entry. Compressed entries are read in chunks of blocks, all submitted at once, and the blocks of each
+    // chunk are decompressed in parallel on the workers as soon as it arrives, while later chunks are still being
+    // read. The result is released with FileIO::releaseData like any other.
+    Task<FileData> read(const PackEntry *entry) const;
+};
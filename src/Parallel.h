@@ -0,0 +1,175 @@
+#pragma once
+
+#include "JobSystem.h"
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+// Data-parallel algorithms on top of JobScope. They all block until done, running jobs while waiting, and may be
+// called from inside jobs.
+
+
+template <typename RangeFunc>
+void parallelForSplit(JobScope &rootScope, int begin, int end, int grainSize, const RangeFunc &func) {
+    // the children are attached to a scope that this call waits for, since the active scope of the thread running
+    // us may be unrelated to rootScope
+    JobScope scope(rootScope);
+    while (end - begin > grainSize) {
+        if (JobSystem::isLocalQueueEmpty()) {
+            // nothing of ours is left for others to steal, so offer them half of what remains
+            int middle = begin + (end - begin) / 2;
+            Job::enqueue([&rootScope, middle, end, grainSize, &func] {
+                parallelForSplit(rootScope, middle, end, grainSize, func);
+            });
+            end = middle;
+        } else {
+            func(begin, begin + grainSize);
+            begin += grainSize;
+        }
+    }
+    if (begin < end) {
+        func(begin, end);
+    }
+}
+
+// Calls func(rangeBegin, rangeEnd) on disjoint sub-ranges covering [begin, end), none smaller than grainSize unless
+// the whole range is. The range is first cut into one piece per thread, enqueued as a batch. Each piece is then
+// split lazily: half of what remains is split off only when the own queue has run dry, so there is no splitting
+// overhead while every thread is busy.
+template <typename RangeFunc>
+void parallelForRange(int begin, int end, const RangeFunc &func, int grainSize = 1) {
+    if (grainSize < 1) {
+        grainSize = 1;
+    }
+    if (end - begin <= grainSize) {
+        if (begin < end) {
+            func(begin, end);
+        }
+        return;
+    }
+    JobScope scope;
+    int pieces = std::min(JobSystem::getThreadCount(), (end - begin + grainSize - 1) / grainSize);
+    Job::enqueueBatch(pieces, [&scope, &func, begin, end, grainSize, pieces] (int piece) {
+        int pieceBegin = begin + (int)((long long)(end - begin) * piece / pieces);
+        int pieceEnd = begin + (int)((long long)(end - begin) * (piece + 1) / pieces);
+        parallelForSplit(scope, pieceBegin, pieceEnd, grainSize, func);
+    });
+}
+
+// Calls func(i) for every i in [begin, end)
+template <typename Func>
+void parallelFor(int begin, int end, const Func &func, int grainSize = 1) {
+    parallelForRange(begin, end, [&func] (int rangeBegin, int rangeEnd) {
+        for (int i = rangeBegin; i < rangeEnd; ++i) {
+            func(i);
+        }
+    }, grainSize);
+}
+
+// Reduces [begin, end) by combining map(rangeBegin, rangeEnd) of consecutive sub-ranges. The partial results are
+// combined in range order on the calling thread, so the result is deterministic even for non-associative
+// operations like floating point addition.
+template <typename T, typename MapFunc, typename CombineFunc>
+T parallelReduce(int begin, int end, T identity, const MapFunc &map, const CombineFunc &combine, int grainSize = 1) {
+    if (grainSize < 1) {
+        grainSize = 1;
+    }
+    if (end - begin <= grainSize) {
+        return begin < end ? combine(identity, map(begin, end)) : identity;
+    }
+    int chunks = std::min(JobSystem::getThreadCount() * 4, (end - begin + grainSize - 1) / grainSize);
+    std::vector<T> partials(chunks, identity);
+    {
+        JobScope scope;
+        Job::enqueueBatch(chunks, [&partials, &map, begin, end, chunks] (int chunk) {
+            int chunkBegin = begin + (int)((long long)(end - begin) * chunk / chunks);
+            int chunkEnd = begin + (int)((long long)(end - begin) * (chunk + 1) / chunks);
+            partials[chunk] = map(chunkBegin, chunkEnd);
+        });
+    }
+    T result = identity;
+    for (auto &partial : partials) {
+        result = combine(result, partial);
+    }
+    return result;
+}
+
+
+// one round of merging pairs of sorted runs. each pair is merged by several jobs, which split the first run evenly
+// and find the matching split points in the second run by binary search
+template <typename SrcIt, typename DstIt, typename Compare>
+void parallelMergeRound(SrcIt src, DstIt dst, const std::vector<size_t> &bounds, int runsPerSide, int partsPerPair, Compare &comp) {
+    struct Round {
+        SrcIt src;
+        DstIt dst;
+        const std::vector<size_t> &bounds;
+        Compare &comp;
+        int runCount;
+        int runsPerSide;
+        int partsPerPair;
+    };
+    Round round { src, dst, bounds, comp, (int)bounds.size() - 1, runsPerSide, partsPerPair };
+    int pairCount = (round.runCount + 2 * runsPerSide - 1) / (2 * runsPerSide);
+
+    JobScope scope;
+    Job::enqueueBatch(pairCount * partsPerPair, [&round] (int index) {
+        int pair = index / round.partsPerPair;
+        int part = index % round.partsPerPair;
+        SrcIt src = round.src;
+        size_t lo = round.bounds[pair * 2 * round.runsPerSide];
+        size_t mid = round.bounds[std::min(pair * 2 * round.runsPerSide + round.runsPerSide, round.runCount)];
+        size_t hi = round.bounds[std::min(pair * 2 * round.runsPerSide + 2 * round.runsPerSide, round.runCount)];
+        size_t aBegin = lo + (mid - lo) * part / round.partsPerPair;
+        size_t aEnd = lo + (mid - lo) * (part + 1) / round.partsPerPair;
+        size_t bBegin = part == 0 ? mid : std::lower_bound(src + mid, src + hi, src[aBegin], round.comp) - src;
+        size_t bEnd = part == round.partsPerPair - 1 ? hi : std::lower_bound(src + mid, src + hi, src[aEnd], round.comp) - src;
+        std::merge(std::make_move_iterator(src + aBegin), std::make_move_iterator(src + aEnd),
+            std::make_move_iterator(src + bBegin), std::make_move_iterator(src + bEnd),
+            round.dst + aBegin + (bBegin - mid), round.comp);
+    });
+}
+
+// Parallel merge sort: runs are sorted with std::sort in parallel, then merged pairwise in rounds, where each merge is
+// itself split across jobs. Needs a temporary buffer of n default-constructible elements. Not stable.
+template <typename RandomIt, typename Compare = std::less<>>
+void parallelSort(RandomIt first, RandomIt last, Compare comp = Compare()) {
+    using T = typename std::iterator_traits<RandomIt>::value_type;
+    size_t n = last - first;
+    int threadCount = JobSystem::getThreadCount();
+    if (n < 4096 || threadCount < 2) {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    int runCount = threadCount * 2;
+    std::vector<size_t> bounds(runCount + 1);
+    for (int i = 0; i <= runCount; ++i) {
+        bounds[i] = n * i / runCount;
+    }
+    {
+        JobScope scope;
+        Job::enqueueBatch(runCount, [first, &bounds, &comp] (int run) {
+            std::sort(first + bounds[run], first + bounds[run + 1], comp);
+        });
+    }
+
+    std::vector<T> buffer(n);
+    bool inBuffer = false;
+    for (int runsPerSide = 1; runsPerSide < runCount; runsPerSide *= 2) {
+        int pairCount = (runCount + 2 * runsPerSide - 1) / (2 * runsPerSide);
+        int partsPerPair = std::max(1, threadCount * 2 / pairCount);
+        if (inBuffer) {
+            parallelMergeRound(buffer.data(), first, bounds, runsPerSide, partsPerPair, comp);
+        } else {
+            parallelMergeRound(first, buffer.data(), bounds, runsPerSide, partsPerPair, comp);
+        }
+        inBuffer = !inBuffer;
+    }
+
+    if (inBuffer) {
+        parallelForRange(0, (int)n, [first, &buffer] (int begin, int end) {
+            std::move(buffer.begin() + begin, buffer.begin() + end, first + begin);
+        }, 16384);
+    }
+}
@@ -123,13 +123,13 @@ void setSkyBoxTexture(const std::string &path) {
 
 void updateSkyBox(RenderContext &context) {
     if (!skyboxPipeline) {
-        if (!vertShader->isLoaded() || !fragShader->isLoaded()) {
+        if (!vertShader->isLoaded() || !fragShader->isLoaded() || vertShader->isFailed() || fragShader->isFailed()) {
             return;
         }
         doInit(context);
     }
     if (!skyboxBindings) {
-        if (!cubemap->isLoaded()) {
+        if (!cubemap->isLoaded() || cubemap->isFailed()) {
             return;
         }
         skyboxBindings = context.device->createBindingSet(nvrhi::BindingSetDesc()
@@ -0,0 +1,293 @@
+#pragma once
+
+#include "JobSystem.h"
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Fire-and-forget coroutine, which starts running immediately and frees itself when done. Used as the root of
+// coroutine chains started from regular code (see spawn). An exception escaping it terminates the program.
+class Coroutine {
+public:
+    struct Promise {
+        Coroutine get_return_object() { return Coroutine {}; }
+        void unhandled_exception() noexcept { std::terminate(); }
+        void return_void() noexcept { }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+    };
+    using promise_type = Promise;
+};
+
+
+template <typename T = void>
+class Task;
+
+class TaskPromiseBase {
+public:
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    // when the task finishes, the awaiting coroutine continues directly on the same thread (symmetric transfer)
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept { }
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+template <typename T>
+class TaskPromise : public TaskPromiseBase {
+    std::optional<T> value;
+
+public:
+    Task<T> get_return_object() noexcept;
+
+    template <typename U>
+    void return_value(U &&result) {
+        value.emplace(std::forward<U>(result));
+    }
+
+    T &result() {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+        return *value;
+    }
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+    Task<void> get_return_object() noexcept;
+
+    void return_void() noexcept { }
+
+    void result() {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+// Lazily started coroutine producing a T. It starts when first awaited, and the awaiter continues when it finishes,
+// on whichever thread that happens. Exceptions propagate to the awaiter. Awaiting an lvalue task leaves the result
+// in the task (see result()), awaiting an rvalue moves it out.
+template <typename T>
+class Task {
+public:
+    using promise_type = TaskPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+private:
+    Handle handle;
+
+    template <bool Move>
+    struct Awaiter {
+        Handle handle;
+
+        bool await_ready() const noexcept { return handle.done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+            handle.promise().continuation = continuation;
+            return handle;
+        }
+
+        decltype(auto) await_resume() {
+            if constexpr (std::is_void_v<T>) {
+                handle.promise().result();
+            } else if constexpr (Move) {
+                return T(std::move(handle.promise().result()));
+            } else {
+                return (handle.promise().result());
+            }
+        }
+    };
+
+public:
+    Task() noexcept : handle(nullptr) { }
+    explicit Task(Handle handle) noexcept : handle(handle) { }
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) { }
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (handle) {
+            handle.destroy(); // must not be called while the task is running
+        }
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    bool isDone() const noexcept { return handle && handle.done(); }
+
+    decltype(auto) result() {
+        return handle.promise().result();
+    }
+
+    Awaiter<false> operator co_await() & noexcept { return Awaiter<false> { handle }; }
+    Awaiter<true> operator co_await() && noexcept { return Awaiter<true> { handle }; }
+};
+
+template <typename T>
+inline Task<T> TaskPromise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// starts a task from regular code, without waiting for it. it is freed when done
+inline Coroutine spawn(Task<> task) {
+    co_await task;
+}
+
+
+struct WhenAllState {
+    std::atomic<int> remaining;
+    std::coroutine_handle<> continuation;
+};
+
+template <typename Awaitable>
+Coroutine whenAllHelper(Awaitable &awaitable, WhenAllState &state) {
+    try {
+        co_await awaitable;
+    } catch (...) {
+        // stays retrievable from the awaitable (like Task::result)
+    }
+    if (state.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        state.continuation.resume();
+    }
+}
+
+// Awaits all the awaitables concurrently, and continues on the thread that completes the last one. Results are left
+// in the awaitables, so pass tasks as lvalues to get at them.
+template <typename... Awaitables>
+auto whenAll(Awaitables &&... awaitables) {
+    struct Awaiter {
+        std::tuple<Awaitables &...> awaitables;
+        WhenAllState state;
+
+        bool await_ready() const noexcept { return sizeof...(Awaitables) == 0; }
+
+        bool await_suspend(std::coroutine_handle<> continuation) {
+            state.continuation = continuation;
+            // the extra count keeps the helpers from resuming us while we are still starting them
+            state.remaining.store(sizeof...(Awaitables) + 1, std::memory_order_relaxed);
+            std::apply([this] (auto &... awaitable) { (whenAllHelper(awaitable, state), ...); }, awaitables);
+            return state.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+        }
+
+        void await_resume() const noexcept { }
+    };
+    return Awaiter { std::tuple<Awaitables &...>(awaitables...), {} };
+}
+
+template <typename T>
+auto whenAll(std::vector<Task<T>> &tasks) {
+    struct Awaiter {
+        std::vector<Task<T>> &tasks;
+        WhenAllState state;
+
+        bool await_ready() const noexcept { return tasks.empty(); }
+
+        bool await_suspend(std::coroutine_handle<> continuation) {
+            state.continuation = continuation;
+            state.remaining.store((int)tasks.size() + 1, std::memory_order_relaxed);
+            for (auto &task : tasks) {
+                whenAllHelper(task, state);
+            }
+            return state.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+        }
+
+        void await_resume() const noexcept { }
+    };
+    return Awaiter { tasks, {} };
+}
+
+
+struct WhenAnyState {
+    std::atomic<int> refCount;
+    std::atomic<int> pending { 2 }; // the first completion, and the awaiter having started all helpers
+    std::atomic<bool> done { false };
+    size_t index = 0;
+    std::coroutine_handle<> continuation;
+
+    void release() {
+        if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+};
+
+// Awaitable is a reference for awaitables passed as lvalues, which then must outlive their completion. rvalues (like
+// tasks) are moved into the helper, which keeps them alive until they complete
+template <typename Awaitable>
+Coroutine whenAnyHelper(Awaitable awaitable, WhenAnyState *state, size_t index) {
+    try {
+        co_await awaitable;
+    } catch (...) {
+    }
+    if (!state->done.exchange(true, std::memory_order_acq_rel)) {
+        state->index = index;
+        if (state->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            state->continuation.resume();
+        }
+    }
+    state->release();
+}
+
+// Awaits the awaitables concurrently, and continues with the index of the first one to complete, on the thread that
+// completed it. The others keep running: lvalues must stay alive until they complete, rvalues are kept alive here.
+template <typename... Awaitables>
+auto whenAny(Awaitables &&... awaitables) {
+    static_assert(sizeof...(Awaitables) > 0);
+
+    struct Awaiter {
+        std::tuple<Awaitables &&...> awaitables; // temporaries live until the end of the co_await expression
+        WhenAnyState *state;
+
+        ~Awaiter() {
+            state->release();
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> continuation) {
+            state->continuation = continuation;
+            [this] <size_t... I> (std::index_sequence<I...>) {
+                (whenAnyHelper<Awaitables>(std::forward<Awaitables>(std::get<I>(awaitables)), state, I), ...);
+            } (std::index_sequence_for<Awaitables...>());
+            return state->pending.fetch_sub(1, std::memory_order_acq_rel) != 1;
+        }
+
+        size_t await_resume() const noexcept { return state->index; }
+    };
+    WhenAnyState *state = new WhenAnyState;
+    state->refCount.store(sizeof...(Awaitables) + 1, std::memory_order_relaxed);
+    return Awaiter { std::tuple<Awaitables &&...>(std::forward<Awaitables>(awaitables)...), state };
+}
@@ -0,0 +1,86 @@
+#include "TaskGraph.h"
+
+#include <cassert>
+
+
+void TaskGraph::addDependency(TaskId task, TaskId predecessor) {
+    assert(task >= 0 && task < (TaskId)tasks.size());
+    assert(predecessor >= 0 && predecessor < (TaskId)tasks.size());
+    assert(task != predecessor);
+    tasks[predecessor].successors.push_back(task);
+    ++tasks[task].predecessorCount;
+    dirty = true;
+}
+
+// recomputes what's derived from the graph structure, and verifies that it has no cycles
+void TaskGraph::prepare() {
+    int count = (int)tasks.size();
+    remainingPredecessors.reset(new std::atomic<int>[count]);
+    roots.clear();
+    for (TaskId id = 0; id < count; ++id) {
+        if (!tasks[id].predecessorCount) {
+            roots.push_back(id);
+        }
+    }
+
+#ifndef NDEBUG
+    // Kahn's algorithm: every task must be reached when repeatedly removing tasks without predecessors
+    std::vector<int> remaining(count);
+    std::vector<TaskId> ready(roots);
+    for (TaskId id = 0; id < count; ++id) {
+        remaining[id] = tasks[id].predecessorCount;
+    }
+    int visited = 0;
+    while (!ready.empty()) {
+        TaskId id = ready.back();
+        ready.pop_back();
+        ++visited;
+        for (TaskId successor : tasks[id].successors) {
+            if (!--remaining[successor]) {
+                ready.push_back(successor);
+            }
+        }
+    }
+    assert(visited == count && "TaskGraph has a cycle");
+#endif
+
+    dirty = false;
+}
+
+void TaskGraph::run() {
+    if (dirty) {
+        prepare();
+    }
+    for (TaskId id = 0; id < (TaskId)tasks.size(); ++id) {
+        remainingPredecessors[id].store(tasks[id].predecessorCount, std::memory_order_relaxed);
+    }
+
+    JobScope scope;
+    runScope = &scope;
+    for (TaskId id : roots) {
+        Job::enqueueIn(scope, [this, id] { runTask(id); });
+    }
+    // the scope counts every task job, including successors enqueued from other threads, so leaving it means all are done
+}
+
+void TaskGraph::runTask(TaskId id) {
+    for (;;) {
+        (*tasks[id].func)();
+
+        // successors that became ready are enqueued, except one, which we continue with right here (saves a queue round trip)
+        TaskId next = -1;
+        for (TaskId successor : tasks[id].successors) {
+            if (remainingPredecessors[successor].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                if (next < 0) {
+                    next = successor;
+                } else {
+                    Job::enqueueIn(*runScope, [this, successor] { runTask(successor); });
+                }
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        id = next;
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "JobSystem.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// A DAG of tasks that is built once and run many times (like once per frame). Tasks become ready when all their
+// predecessors have finished, which is tracked by decrementing per-task counters, so no thread blocks waiting on
+// an individual task. Running the graph doesn't allocate, unless its structure changed since the last run.
+class TaskGraph {
+public:
+    typedef int TaskId;
+
+    TaskGraph() = default;
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    template <typename Func>
+    TaskId addTask(Func &&func) {
+        tasks.emplace_back();
+        tasks.back().func.reset(new TaskFuncImpl<std::decay_t<Func>>(std::forward<Func>(func)));
+        dirty = true;
+        return (TaskId)tasks.size() - 1;
+    }
+
+    // task will not start before predecessor has finished
+    void addDependency(TaskId task, TaskId predecessor);
+
+    // runs all tasks, and returns when they have finished. runs other jobs while waiting
+    void run();
+
+private:
+    struct TaskFunc {
+        virtual ~TaskFunc() { }
+        virtual void operator()() = 0;
+    };
+
+    template <typename Func>
+    struct TaskFuncImpl : TaskFunc {
+        Func func;
+        template <typename F>
+        TaskFuncImpl(F &&func) : func(std::forward<F>(func)) { }
+        void operator()() override { func(); }
+    };
+
+    struct Task {
+        std::unique_ptr<TaskFunc> func;
+        std::vector<TaskId> successors;
+        int predecessorCount = 0;
+    };
+
+    std::vector<Task> tasks;
+    std::vector<TaskId> roots;
+    std::unique_ptr<std::atomic<int>[]> remainingPredecessors;
+    JobScope *runScope = nullptr;
+    bool dirty = false;
+
+    void prepare();
+    void runTask(TaskId id);
+};
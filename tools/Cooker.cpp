@@ -0,0 +1,435 @@
+#include "../src/CookedFormats.h"
+#include "../src/JobSystem.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Converts source assets into the formats of CookedFormats.h, so the game doesn't have to at load time:
+//
+//     cooker assets/textures assets/meshes
+//
+// Images (.jpg, .png, .tga, .bmp) become textures with full mip chains. Images six times as tall as wide are taken
+// to be cubes, and cut into faces. ASCII PLY meshes become vertex and triangle index arrays. Each asset is cooked in
+// a job, and the faces of a cube in jobs of their own. Assets whose cooked output was made from the same content by
+// the same COOKER_VERSION are skipped, unless --force is given.
+
+#define COOKER_VERSION 1 // bump when the output for a given input changes
+
+enum AssetKind { ASSET_NONE, ASSET_TEXTURE, ASSET_MESH };
+
+struct CookItem {
+    std::string sourcePath;
+    std::string outputPath;
+    AssetKind kind;
+};
+
+static std::atomic<int> cookedCount;
+static std::atomic<int> upToDateCount;
+static std::atomic<int> failedCount;
+
+
+static AssetKind getAssetKind(const std::filesystem::path &path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [] (unsigned char c) { return (char)tolower(c); });
+    if (extension == ".jpg" || extension == ".jpeg" || extension == ".png" || extension == ".tga" || extension == ".bmp") {
+        return ASSET_TEXTURE;
+    }
+    if (extension == ".ply") {
+        return ASSET_MESH;
+    }
+    return ASSET_NONE;
+}
+
+static bool readFile(const std::string &path, std::vector<unsigned char> &data) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    data.clear();
+    unsigned char buffer[64 * 1024];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + n);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+// written next to the output and renamed over it, so an interrupted run can't leave a truncated file that looks current
+static bool writeFile(const std::string &path, const void *header, size_t headerSize, const void *data, size_t size) {
+    std::string tempPath = path + ".tmp";
+    FILE *fp = fopen(tempPath.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fwrite(header, 1, headerSize, fp) == headerSize && fwrite(data, 1, size, fp) == size;
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && rename(tempPath.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        remove(tempPath.c_str());
+    }
+    return ok;
+}
+
+// FNV-1a of the cooker version and the content
+static uint64_t hashSource(const std::vector<unsigned char> &data) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint32_t version = COOKER_VERSION;
+    for (size_t i = 0; i < sizeof(version); ++i) {
+        hash = (hash ^ (version >> (i * 8) & 0xff)) * 0x100000001b3ull;
+    }
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static bool isUpToDate(const std::string &outputPath, uint32_t magic, uint64_t sourceHash) {
+    FILE *fp = fopen(outputPath.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    CookedHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1;
+    fclose(fp);
+    return ok && header.magic == magic && header.version == COOKED_FORMAT_VERSION && header.sourceHash == sourceHash;
+}
+
+
+static float srgbToLinearTable[256];
+
+static void initSrgbTable() {
+    for (int i = 0; i < 256; ++i) {
+        float c = i / 255.0f;
+        srgbToLinearTable[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+}
+
+static unsigned char linearToSrgb(float c) {
+    c = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+    return (unsigned char)std::clamp((int)(c * 255 + 0.5f), 0, 255);
+}
+
+// box filters src into a mip half its size (rounded down, at least 1). odd edges are clamped, so the last row or
+// column is averaged with itself. colour is averaged in linear space for sRGB textures
+static void downsample(const unsigned char *src, int srcWidth, int srcHeight, unsigned char *dst, int bytesPerPixel, bool srgb) {
+    int dstWidth = std::max(1, srcWidth / 2);
+    int dstHeight = std::max(1, srcHeight / 2);
+    for (int y = 0; y < dstHeight; ++y) {
+        int y0 = std::min(y * 2, srcHeight - 1);
+        int y1 = std::min(y * 2 + 1, srcHeight - 1);
+        for (int x = 0; x < dstWidth; ++x) {
+            int x0 = std::min(x * 2, srcWidth - 1);
+            int x1 = std::min(x * 2 + 1, srcWidth - 1);
+            const unsigned char *p[4] = {
+                src + ((size_t)y0 * srcWidth + x0) * bytesPerPixel,
+                src + ((size_t)y0 * srcWidth + x1) * bytesPerPixel,
+                src + ((size_t)y1 * srcWidth + x0) * bytesPerPixel,
+                src + ((size_t)y1 * srcWidth + x1) * bytesPerPixel,
+            };
+            unsigned char *out = dst + ((size_t)y * dstWidth + x) * bytesPerPixel;
+            for (int c = 0; c < bytesPerPixel; ++c) {
+                if (srgb && c < 3) {
+                    float sum = srgbToLinearTable[p[0][c]] + srgbToLinearTable[p[1][c]] + srgbToLinearTable[p[2][c]] + srgbToLinearTable[p[3][c]];
+                    out[c] = linearToSrgb(sum / 4);
+                } else {
+                    out[c] = (unsigned char)((p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) / 4);
+                }
+            }
+        }
+    }
+}
+
+static bool cookTexture(const CookItem &item, const std::vector<unsigned char> &source, uint64_t sourceHash) {
+    int width, height, comp;
+    if (!stbi_info_from_memory(source.data(), (int)source.size(), &width, &height, &comp)) {
+        fprintf(stderr, "%s: %s\n", item.sourcePath.c_str(), stbi_failure_reason());
+        return false;
+    }
+    // the same formats the loader picks for the source image
+    int reqComp = 0;
+    CookedTextureFormat format;
+    switch (comp) {
+        case 1: format = COOKED_R8; break;
+        case 2: format = COOKED_RG8; break;
+        default: format = COOKED_SRGBA8; reqComp = 4; break;
+    }
+    int bytesPerPixel = (int)format;
+    unsigned char *pixels = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &comp, reqComp);
+    if (!pixels) {
+        fprintf(stderr, "%s: %s\n", item.sourcePath.c_str(), stbi_failure_reason());
+        return false;
+    }
+
+    int arraySize = height == width * 6 ? 6 : 1;
+    int sliceHeight = height / arraySize;
+    int mipLevels = 1;
+    while (std::max(width, sliceHeight) >> mipLevels) {
+        ++mipLevels;
+    }
+    std::vector<size_t> mipOffsets(mipLevels + 1); // within a slice
+    for (int mip = 0; mip < mipLevels; ++mip) {
+        size_t mipSize = (size_t)std::max(1, width >> mip) * std::max(1, sliceHeight >> mip) * bytesPerPixel;
+        mipOffsets[mip + 1] = mipOffsets[mip] + mipSize;
+    }
+    size_t sliceSize = mipOffsets[mipLevels];
+    std::vector<unsigned char> data(sliceSize * arraySize);
+
+    {
+        JobScope scope;
+        Job::enqueueBatch(arraySize, [&] (int slice) {
+            unsigned char *out = data.data() + slice * sliceSize;
+            memcpy(out, pixels + slice * mipOffsets[1], mipOffsets[1]);
+            for (int mip = 1; mip < mipLevels; ++mip) {
+                downsample(out + mipOffsets[mip - 1], std::max(1, width >> (mip - 1)), std::max(1, sliceHeight >> (mip - 1)),
+                    out + mipOffsets[mip], bytesPerPixel, format == COOKED_SRGBA8);
+            }
+        });
+    }
+    stbi_image_free(pixels);
+
+    CookedTextureHeader header = {};
+    header.header.magic = COOKED_TEXTURE_MAGIC;
+    header.header.version = COOKED_FORMAT_VERSION;
+    header.header.sourceHash = sourceHash;
+    header.format = format;
+    header.width = width;
+    header.height = sliceHeight;
+    header.arraySize = arraySize;
+    header.mipLevels = mipLevels;
+    return writeFile(item.outputPath, &header, sizeof(header), data.data(), data.size());
+}
+
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<std::string> properties; // a list property is named here, but read as a count and its items
+};
+
+static const char *nextLine(const char *p, const char *end) {
+    while (p < end && *p != '\n') {
+        ++p;
+    }
+    return p < end ? p + 1 : end;
+}
+
+// ASCII PLY, as exported by Blender. faces are triangulated as fans
+static bool cookMesh(const CookItem &item, std::vector<unsigned char> &source, uint64_t sourceHash) {
+    source.push_back(0); // strtof and friends need a terminator
+    const char *p = (const char *)source.data();
+    const char *end = p + source.size() - 1;
+    if (strncmp(p, "ply", 3) != 0) {
+        fprintf(stderr, "%s: not a PLY file\n", item.sourcePath.c_str());
+        return false;
+    }
+
+    std::vector<PlyElement> elements;
+    bool ascii = false;
+    for (p = nextLine(p, end); p < end; p = nextLine(p, end)) {
+        char word[64], name[64];
+        unsigned long long count;
+        if (!strncmp(p, "end_header", 10)) {
+            p = nextLine(p, end);
+            break;
+        } else if (!strncmp(p, "format ascii", 12)) {
+            ascii = true;
+        } else if (sscanf(p, "element %63s %llu", name, &count) == 2) {
+            elements.push_back({ name, (size_t)count, {} });
+        } else if (!elements.empty() && sscanf(p, "property list %*s %*s %63s", name) == 1) {
+            elements.back().properties.push_back(name);
+        } else if (!elements.empty() && sscanf(p, "property %63s %63s", word, name) == 2) {
+            elements.back().properties.push_back(name);
+        }
+    }
+    if (!ascii) {
+        fprintf(stderr, "%s: only ASCII PLY is supported\n", item.sourcePath.c_str());
+        return false;
+    }
+
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    uint32_t vertexCount = 0;
+    bool hasNormals = false;
+    for (const PlyElement &element : elements) {
+        if (element.name == "vertex") {
+            // where x y z nx ny nz are among the properties
+            int columns[6] = { -1, -1, -1, -1, -1, -1 };
+            static const char *names[6] = { "x", "y", "z", "nx", "ny", "nz" };
+            for (int i = 0; i < 6; ++i) {
+                auto it = std::find(element.properties.begin(), element.properties.end(), names[i]);
+                columns[i] = it != element.properties.end() ? (int)(it - element.properties.begin()) : -1;
+            }
+            if (columns[0] < 0 || columns[1] < 0 || columns[2] < 0) {
+                fprintf(stderr, "%s: vertices have no position\n", item.sourcePath.c_str());
+                return false;
+            }
+            hasNormals = columns[3] >= 0 && columns[4] >= 0 && columns[5] >= 0;
+            int stride = hasNormals ? 6 : 3;
+            vertexCount = (uint32_t)element.count;
+            vertices.resize((size_t)vertexCount * stride);
+            std::vector<float> values(element.properties.size());
+            for (size_t v = 0; v < element.count; ++v) {
+                char *next;
+                for (size_t i = 0; i < values.size(); ++i) {
+                    values[i] = strtof(p, &next);
+                    if (next == p) {
+                        fprintf(stderr, "%s: bad vertex %zu\n", item.sourcePath.c_str(), v);
+                        return false;
+                    }
+                    p = next;
+                }
+                for (int i = 0; i < stride; ++i) {
+                    vertices[v * stride + i] = values[columns[i]];
+                }
+                p = nextLine(p, end);
+            }
+        } else if (element.name == "face") {
+            for (size_t f = 0; f < element.count; ++f) {
+                char *next;
+                unsigned long count = strtoul(p, &next, 10);
+                if (next == p || count < 3) {
+                    fprintf(stderr, "%s: bad face %zu\n", item.sourcePath.c_str(), f);
+                    return false;
+                }
+                p = next;
+                uint32_t first = 0, previous = 0;
+                for (unsigned long i = 0; i < count; ++i) {
+                    unsigned long index = strtoul(p, &next, 10);
+                    if (next == p || index >= vertexCount) {
+                        fprintf(stderr, "%s: bad face %zu\n", item.sourcePath.c_str(), f);
+                        return false;
+                    }
+                    p = next;
+                    if (i == 0) {
+                        first = (uint32_t)index;
+                    } else if (i >= 2) {
+                        indices.push_back(first);
+                        indices.push_back(previous);
+                        indices.push_back((uint32_t)index);
+                    }
+                    previous = (uint32_t)index;
+                }
+                p = nextLine(p, end);
+            }
+        } else {
+            for (size_t i = 0; i < element.count; ++i) {
+                p = nextLine(p, end);
+            }
+        }
+    }
+
+    std::vector<unsigned char> data(vertices.size() * sizeof(float) + indices.size() * sizeof(uint32_t));
+    if (!vertices.empty()) {
+        memcpy(data.data(), vertices.data(), vertices.size() * sizeof(float));
+    }
+    if (!indices.empty()) {
+        memcpy(data.data() + vertices.size() * sizeof(float), indices.data(), indices.size() * sizeof(uint32_t));
+    }
+    CookedMeshHeader header = {};
+    header.header.magic = COOKED_MESH_MAGIC;
+    header.header.version = COOKED_FORMAT_VERSION;
+    header.header.sourceHash = sourceHash;
+    header.vertexCount = vertexCount;
+    header.indexCount = (uint32_t)indices.size();
+    header.flags = hasNormals ? COOKED_MESH_NORMALS : 0;
+    return writeFile(item.outputPath, &header, sizeof(header), data.data(), data.size());
+}
+
+
+static void cook(const CookItem &item, bool force) {
+    std::vector<unsigned char> source;
+    if (!readFile(item.sourcePath, source)) {
+        fprintf(stderr, "%s: could not read\n", item.sourcePath.c_str());
+        ++failedCount;
+        return;
+    }
+    uint64_t sourceHash = hashSource(source);
+    uint32_t magic = item.kind == ASSET_TEXTURE ? COOKED_TEXTURE_MAGIC : COOKED_MESH_MAGIC;
+    if (!force && isUpToDate(item.outputPath, magic, sourceHash)) {
+        // the game skips loose cooked files older than their source, so a source that was only touched (or checked
+        // out again) must not make the output look stale
+        std::error_code error;
+        auto sourceTime = std::filesystem::last_write_time(item.sourcePath, error);
+        if (!error && sourceTime > std::filesystem::last_write_time(item.outputPath, error) && !error) {
+            std::filesystem::last_write_time(item.outputPath, std::filesystem::file_time_type::clock::now(), error);
+        }
+        ++upToDateCount;
+        return;
+    }
+    bool ok = item.kind == ASSET_TEXTURE ? cookTexture(item, source, sourceHash) : cookMesh(item, source, sourceHash);
+    if (!ok) {
+        fprintf(stderr, "%s: could not cook\n", item.sourcePath.c_str());
+        ++failedCount;
+        return;
+    }
+    printf("cooked %s\n", item.outputPath.c_str());
+    ++cookedCount;
+}
+
+static void addPath(const std::filesystem::path &path, std::vector<CookItem> &items) {
+    if (std::filesystem::is_directory(path)) {
+        for (auto &child : std::filesystem::recursive_directory_iterator(path)) {
+            if (child.is_regular_file()) {
+                addPath(child.path(), items);
+            }
+        }
+        return;
+    }
+    AssetKind kind = getAssetKind(path);
+    if (kind != ASSET_NONE) {
+        std::string sourcePath = path.generic_string();
+        items.push_back({ sourcePath, getCookedPath(sourcePath, kind == ASSET_TEXTURE ? COOKED_TEXTURE_EXTENSION : COOKED_MESH_EXTENSION), kind });
+    }
+}
+
+int main(int argc, char *argv[]) {
+    bool force = false;
+    int first = 1;
+    if (first < argc && strcmp(argv[first], "--force") == 0) {
+        force = true;
+        ++first;
+    }
+    if (argc - first < 1) {
+        fprintf(stderr, "usage: %s [--force] FILE_OR_DIRECTORY...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<CookItem> items;
+    for (int i = first; i < argc; ++i) {
+        if (!std::filesystem::exists(argv[i])) {
+            fprintf(stderr, "%s: not found\n", argv[i]);
+            return 1;
+        }
+        addPath(argv[i], items);
+    }
+    // created up front, so the jobs don't race to make them
+    for (const CookItem &item : items) {
+        std::error_code error;
+        std::filesystem::create_directories(std::filesystem::path(item.outputPath).parent_path(), error);
+    }
+    initSrgbTable();
+
+    JobSystem::start();
+    {
+        JobScope scope;
+        Job::enqueueBatch((int)items.size(), [&items, force] (int i) {
+            cook(items[i], force);
+        });
+    }
+    JobSystem::stop();
+
+    printf("%d cooked, %d up to date, %d failed\n", cookedCount.load(), upToDateCount.load(), failedCount.load());
+    return failedCount ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+#include "PackWriter.h"
+#include "../src/PackFile.h"
+#include "../src/Lz.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+
+static bool readFile(const std::string &path, std::vector<unsigned char> &data) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    data.clear();
+    unsigned char buffer[64 * 1024];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + n);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+// the block table followed by the blocks. false if it isn't worth it
+static bool compressPayload(const std::vector<unsigned char> &data, std::vector<unsigned char> &payload) {
+    size_t blockCount = (data.size() + PACK_BLOCK_SIZE - 1) / PACK_BLOCK_SIZE;
+    payload.assign(blockCount * sizeof(uint32_t), 0);
+    std::vector<unsigned char> compressed(lzCompressBound(PACK_BLOCK_SIZE));
+    for (size_t i = 0; i < blockCount; ++i) {
+        const unsigned char *block = data.data() + i * PACK_BLOCK_SIZE;
+        size_t size = std::min<size_t>(PACK_BLOCK_SIZE, data.size() - i * PACK_BLOCK_SIZE);
+        // the block is stored as is if compressing doesn't make it smaller
+        size_t compressedSize = lzCompress(block, size, compressed.data(), size - 1);
+        uint32_t storedSize = compressedSize ? (uint32_t)compressedSize : (uint32_t)size;
+        memcpy(payload.data() + i * sizeof(uint32_t), &storedSize, sizeof(storedSize));
+        if (compressedSize) {
+            payload.insert(payload.end(), compressed.data(), compressed.data() + compressedSize);
+        } else {
+            payload.insert(payload.end(), block, block + size);
+        }
+    }
+    return payload.size() < data.size() - data.size() / 8;
+}
+
+static bool writePadding(FILE *fp, uint64_t &offset, uint64_t alignment) {
+    static const char zeros[PACK_ALIGNMENT] = {};
+    uint64_t padding = (alignment - offset % alignment) % alignment;
+    offset += padding;
+    return fwrite(zeros, 1, padding, fp) == padding;
+}
+
+bool writePack(const char *outputPath, std::vector<std::string> paths, bool compress, PackWriteStats &stats) {
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+    FILE *fp = fopen(outputPath, "wb");
+    if (!fp) {
+        fprintf(stderr, "%s: could not create\n", outputPath);
+        return false;
+    }
+    PackHeader header = {};
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1; // written again when the index is known
+    uint64_t offset = sizeof(header);
+
+    // payloads in path order, so the files of a directory are next to each other
+    std::vector<PackEntry> entries;
+    std::string names;
+    std::vector<unsigned char> data, payload;
+    for (const std::string &path : paths) {
+        if (!ok) {
+            break;
+        }
+        if (!readFile(path, data)) {
+            fprintf(stderr, "%s: could not read\n", path.c_str());
+            ok = false;
+            break;
+        }
+        PackEntry entry = {};
+        entry.pathHash = hashPackPath(path.data(), path.size());
+        entry.size = data.size();
+        entry.nameOffset = (uint32_t)names.size();
+        entry.nameLength = (uint32_t)path.size();
+        names += path;
+        const std::vector<unsigned char> *stored = &data;
+        if (compress && !data.empty() && compressPayload(data, payload)) {
+            entry.blockSize = PACK_BLOCK_SIZE;
+            stored = &payload;
+            ++stats.compressedCount;
+        }
+        ok = writePadding(fp, offset, PACK_ALIGNMENT) && fwrite(stored->data(), 1, stored->size(), fp) == stored->size();
+        entry.offset = offset;
+        entry.storedSize = stored->size();
+        offset += stored->size();
+        entries.push_back(entry);
+        ++stats.fileCount;
+        stats.fileBytes += entry.size;
+    }
+
+    std::sort(entries.begin(), entries.end(), [] (const PackEntry &a, const PackEntry &b) {
+        return a.pathHash < b.pathHash;
+    });
+    ok = ok && writePadding(fp, offset, alignof(PackEntry));
+    header.magic = PACK_MAGIC;
+    header.version = PACK_VERSION;
+    header.entryCount = (uint32_t)entries.size();
+    header.namesSize = (uint32_t)names.size();
+    header.indexOffset = offset;
+    ok = ok && fwrite(entries.data(), sizeof(PackEntry), entries.size(), fp) == entries.size();
+    ok = ok && fwrite(names.data(), 1, names.size(), fp) == names.size();
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "%s: could not write\n", outputPath);
+        remove(outputPath);
+        return false;
+    }
+    stats.packBytes = offset + entries.size() * sizeof(PackEntry) + names.size();
+    return true;
+}
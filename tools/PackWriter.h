@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct PackWriteStats {
+    size_t fileCount = 0;
+    size_t compressedCount = 0;
+    uint64_t fileBytes = 0; // total size of the files
+    uint64_t packBytes = 0;
+};
+
+// Writes a pack file (see PackFile.h) of the given files, named by their paths. With compress, files are split
+// into LZ compressed blocks, unless that saves less than an eighth of their size (like for JPEGs).
+bool writePack(const char *outputPath, std::vector<std::string> paths, bool compress, PackWriteStats &stats);
@@ -0,0 +1,56 @@
+#include "PackWriter.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Writes a pack file (see PackFile.h) of the given files, and of all files under the given directories. Entries are
+// named by their paths as given, with forward slashes, which is how the asset loader looks them up:
+//
+//     packer assets.pak assets/shaders/simple.vert.spv assets/textures
+//
+// Files are compressed where it pays off, unless --store is given.
+
+static void addPath(const std::filesystem::path &path, std::vector<std::string> &paths) {
+    if (std::filesystem::is_directory(path)) {
+        for (auto &child : std::filesystem::recursive_directory_iterator(path)) {
+            if (child.is_regular_file()) {
+                paths.push_back(child.path().generic_string());
+            }
+        }
+    } else {
+        paths.push_back(path.generic_string());
+    }
+}
+
+int main(int argc, char *argv[]) {
+    bool compress = true;
+    int first = 1;
+    if (first < argc && strcmp(argv[first], "--store") == 0) {
+        compress = false;
+        ++first;
+    }
+    if (argc - first < 2) {
+        fprintf(stderr, "usage: %s [--store] OUTPUT.pak FILE_OR_DIRECTORY...\n", argv[0]);
+        return 1;
+    }
+    const char *outputPath = argv[first];
+
+    std::vector<std::string> paths;
+    for (int i = first + 1; i < argc; ++i) {
+        if (!std::filesystem::exists(argv[i])) {
+            fprintf(stderr, "%s: not found\n", argv[i]);
+            return 1;
+        }
+        addPath(argv[i], paths);
+    }
+    PackWriteStats stats;
+    if (!writePack(outputPath, paths, compress, stats)) {
+        return 1;
+    }
+    printf("packed %zu files (%zu compressed) into %s, %llu bytes of %llu\n", stats.fileCount, stats.compressedCount,
+        outputPath, (unsigned long long)stats.packBytes, (unsigned long long)stats.fileBytes);
+    return 0;
+}